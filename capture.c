@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+
+#include "capture.h"
+
+// Reads a region of a window, scaled down on the X server with XRender when it is
+// larger than needed, through a shared memory image when XShm is available
+struct capture
+{
+    Display *display;
+    Window w;
+    int shm, render;
+    // Shared memory image, reused while the size does not change
+    XImage *image;
+    XShmSegmentInfo shminfo;
+    // Image read without shared memory or a blank one, freed on the next read
+    XImage *plain;
+    int blank;
+    // The image returned last, returned again when a read fails
+    XImage *last;
+    // The window and its scaled down copy
+    Picture src, dst;
+    Pixmap pixmap;
+    int dst_width, dst_height;
+    // Tile hashes of the previous image and the tiles changed since then
+    uint64_t *hashes;
+    unsigned char *changed;
+    int hash_width, hash_height;
+};
+
+struct capture *capture_open(Display *display, Window w)
+{
+    struct capture *c = (struct capture *)calloc(1, sizeof(*c));
+    int major, minor, event_base, error_base;
+    Bool pixmaps;
+
+    c->display = display;
+    c->w = w;
+    c->shm = XShmQueryVersion(display, &major, &minor, &pixmaps);
+    c->render = XRenderQueryExtension(display, &event_base, &error_base);
+    return c;
+}
+
+static void free_shm_image(struct capture *c)
+{
+    if (!c->image)
+        return;
+    XShmDetach(c->display, &c->shminfo);
+    XDestroyImage(c->image);
+    shmdt(c->shminfo.shmaddr);
+    c->image = 0;
+}
+
+// Shared memory image of the given size, 0 if shared memory cannot be used
+static XImage *get_shm_image(struct capture *c, Visual *visual, int depth, int width, int height)
+{
+    if (c->image && c->image->width == width && c->image->height == height)
+        return c->image;
+    if (c->last == c->image)
+        c->last = 0;
+    free_shm_image(c);
+    c->image = XShmCreateImage(c->display, visual, depth, ZPixmap, 0, &c->shminfo, width, height);
+    if (!c->image)
+    {
+        c->shm = 0;
+        return 0;
+    }
+    c->shminfo.shmid = shmget(IPC_PRIVATE, c->image->bytes_per_line * height, IPC_CREAT | 0600);
+    if (c->shminfo.shmid < 0)
+    {
+        perror("shmget");
+        XDestroyImage(c->image);
+        c->image = 0;
+        c->shm = 0;
+        return 0;
+    }
+    c->shminfo.shmaddr = c->image->data = (char *)shmat(c->shminfo.shmid, 0, 0);
+    c->shminfo.readOnly = False;
+    XShmAttach(c->display, &c->shminfo);
+    XSync(c->display, False);
+    // The segment goes away with the last detach
+    shmctl(c->shminfo.shmid, IPC_RMID, 0);
+    return c->image;
+}
+
+static void free_scaled(struct capture *c)
+{
+    if (c->dst)
+        XRenderFreePicture(c->display, c->dst);
+    if (c->pixmap)
+        XFreePixmap(c->display, c->pixmap);
+    c->dst = 0;
+    c->pixmap = 0;
+}
+
+// Composite the region into a pixmap of width x height, 0 if XRender cannot be used
+static Drawable scale(struct capture *c, const XWindowAttributes *wattr, int x, int y, int width, int height,
+                      int dst_width, int dst_height)
+{
+    XRenderPictFormat *format = XRenderFindVisualFormat(c->display, wattr->visual);
+
+    if (!format)
+    {
+        c->render = 0;
+        return 0;
+    }
+    if (!c->src)
+    {
+        XRenderPictureAttributes pa;
+
+        // Child windows are part of the image
+        pa.subwindow_mode = IncludeInferiors;
+        c->src = XRenderCreatePicture(c->display, c->w, format, CPSubwindowMode, &pa);
+        XRenderSetPictureFilter(c->display, c->src, FilterGood, 0, 0);
+    }
+    if (!c->pixmap || c->dst_width != dst_width || c->dst_height != dst_height)
+    {
+        free_scaled(c);
+        c->pixmap = XCreatePixmap(c->display, c->w, dst_width, dst_height, wattr->depth);
+        c->dst = XRenderCreatePicture(c->display, c->pixmap, format, 0, 0);
+        c->dst_width = dst_width;
+        c->dst_height = dst_height;
+    }
+    // The transform maps destination pixels to the region in the window
+    XTransform transform = {{{XDoubleToFixed((double)width / dst_width), 0, XDoubleToFixed(x)},
+                             {0, XDoubleToFixed((double)height / dst_height), XDoubleToFixed(y)},
+                             {0, 0, XDoubleToFixed(1)}}};
+    XRenderSetPictureTransform(c->display, c->src, &transform);
+    XRenderComposite(c->display, PictOpSrc, c->src, None, c->dst, 0, 0, 0, 0, 0, 0, dst_width, dst_height);
+    return c->pixmap;
+}
+
+// Size of the region scaled down to fit into max_width x max_height keeping the aspect ratio
+static double fit(int width, int height, int max_width, int max_height)
+{
+    double factor = (double)max_width / width;
+
+    if ((double)max_height / height < factor)
+        factor = (double)max_height / height;
+    return factor;
+}
+
+static void set_plain(struct capture *c, XImage *image, int blank)
+{
+    if (c->plain)
+        XDestroyImage(c->plain);
+    c->plain = image;
+    c->blank = blank;
+}
+
+// Read the region, scaled down to fit into max_width x max_height keeping the aspect ratio.
+// The image belongs to the capture and stays valid until the next call. When the region cannot
+// be read, the previous image is returned again, or 0 if there is none
+XImage *capture_get(struct capture *c, const XWindowAttributes *wattr, int x, int y, int width, int height,
+                    int max_width, int max_height)
+{
+    double factor = fit(width, height, max_width, max_height);
+    Drawable d = c->w;
+    XImage *image;
+
+    if (c->render && factor < 1)
+    {
+        int dst_width = (int)(width * factor + 0.5), dst_height = (int)(height * factor + 0.5);
+
+        d = scale(c, wattr, x, y, width, height, dst_width ? dst_width : 1, dst_height ? dst_height : 1);
+        if (d)
+        {
+            x = y = 0;
+            width = c->dst_width;
+            height = c->dst_height;
+        }
+        else
+            d = c->w;
+    }
+    if (c->shm && get_shm_image(c, wattr->visual, wattr->depth, width, height) &&
+        XShmGetImage(c->display, d, c->image, x, y, AllPlanes))
+    {
+        set_plain(c, 0, 0);
+        return c->last = c->image;
+    }
+    image = XGetImage(c->display, d, x, y, width, height, AllPlanes, ZPixmap);
+    if (!image)
+        return c->last;
+    set_plain(c, image, 0);
+    return c->last = image;
+}
+
+// A black image of the size capture_get would return, shown while the window is not visible
+XImage *capture_blank(struct capture *c, const XWindowAttributes *wattr, int width, int height, int max_width,
+                      int max_height)
+{
+    double factor = fit(width, height, max_width, max_height);
+    XImage *image;
+
+    if (factor < 1)
+    {
+        width = (int)(width * factor + 0.5);
+        height = (int)(height * factor + 0.5);
+    }
+    width = width > 0 ? width : 1;
+    height = height > 0 ? height : 1;
+    if (c->blank && c->plain->width == width && c->plain->height == height)
+        return c->last = c->plain;
+    image = XCreateImage(c->display, wattr->visual, wattr->depth, ZPixmap, 0, 0, width, height, 32, 0);
+    if (!image)
+        return c->last;
+    image->data = (char *)calloc(image->bytes_per_line, height);
+    set_plain(c, image, 1);
+    return c->last = image;
+}
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+
+static uint64_t round64(uint64_t acc, uint64_t v)
+{
+    acc += v * PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * PRIME1;
+}
+
+// Hash a tile of 32 bit pixels, four independent lanes let the compiler vectorize the loop
+static uint64_t hash_tile(const char *data, int stride, int width, int height)
+{
+    uint64_t acc[4] = {PRIME1, PRIME2, ~PRIME1, ~PRIME2};
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+        int x = 0;
+
+        for (; x + 8 <= width; x += 8)
+            for (int i = 0; i < 4; i++)
+                acc[i] = round64(acc[i], row[x + 2 * i] | (uint64_t)row[x + 2 * i + 1] << 32);
+        for (; x < width; x++)
+            acc[x & 3] = round64(acc[x & 3], row[x]);
+    }
+    return acc[0] ^ (acc[1] * 3) ^ (acc[2] * 5) ^ (acc[3] * 7);
+}
+
+// Compare the image with the previous one tile by tile. changed gets one byte per tile,
+// nonzero for the tiles that changed, and the number of changed tiles is returned
+int capture_changes(struct capture *c, const XImage *image, const unsigned char **changed, int *columns, int *rows)
+{
+    int n = 0, cols = (image->width + CAPTURE_TILE - 1) / CAPTURE_TILE;
+    int nrows = (image->height + CAPTURE_TILE - 1) / CAPTURE_TILE;
+    int reset = image->width != c->hash_width || image->height != c->hash_height;
+
+    // Everything changed with the size
+    if (reset)
+    {
+        free(c->hashes);
+        free(c->changed);
+        c->hashes = (uint64_t *)calloc(cols * nrows, sizeof(*c->hashes));
+        c->changed = (unsigned char *)malloc(cols * nrows);
+        c->hash_width = image->width;
+        c->hash_height = image->height;
+    }
+    for (int ty = 0; ty < nrows; ty++)
+        for (int tx = 0; tx < cols; tx++)
+        {
+            int x = tx * CAPTURE_TILE, y = ty * CAPTURE_TILE;
+            int width = image->width - x < CAPTURE_TILE ? image->width - x : CAPTURE_TILE;
+            int height = image->height - y < CAPTURE_TILE ? image->height - y : CAPTURE_TILE;
+            uint64_t hash = hash_tile(image->data + (size_t)y * image->bytes_per_line + x * 4,
+                                      image->bytes_per_line, width, height);
+            int i = ty * cols + tx;
+
+            c->changed[i] = reset || hash != c->hashes[i];
+            c->hashes[i] = hash;
+            n += c->changed[i];
+        }
+    *changed = c->changed;
+    *columns = cols;
+    *rows = nrows;
+    return n;
+}
+
+void capture_close(struct capture *c)
+{
+    free(c->hashes);
+    free(c->changed);
+    free_shm_image(c);
+    if (c->plain)
+        XDestroyImage(c->plain);
+    free_scaled(c);
+    if (c->src)
+        XRenderFreePicture(c->display, c->src);
+    free(c);
+}
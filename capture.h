@@ -0,0 +1,28 @@
+#ifndef _CAPTURE_H_INCLUDED_
+#define _CAPTURE_H_INCLUDED_
+
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Size of the tiles compared between frames
+#define CAPTURE_TILE 64
+
+    struct capture;
+
+    struct capture *capture_open(Display *display, Window w);
+    XImage *capture_get(struct capture *c, const XWindowAttributes *wattr, int x, int y, int width, int height,
+                        int max_width, int max_height);
+    XImage *capture_blank(struct capture *c, const XWindowAttributes *wattr, int width, int height, int max_width,
+                          int max_height);
+    int capture_changes(struct capture *c, const XImage *image, const unsigned char **changed, int *columns, int *rows);
+    void capture_close(struct capture *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
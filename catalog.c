@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "catalog.h"
+#include "xconn.h"
+
+// The window catalog is a snapshot of the client windows, kept up to date
+// by a thread listening for PropertyNotify events on the event connection,
+// so that Browse and stream lookup never need an X round trip
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct catalog_item *catalog_items;
+static int catalog_nitems;
+// Open addressing hash table of positions in catalog_items, keyed by window ID
+static int *catalog_index;
+static unsigned catalog_index_mask;
+// Incremented whenever the window set or a title changes
+static unsigned catalog_update_id = 1;
+static void (*catalog_listener)();
+static Display *catalog_display;
+static Window catalog_root;
+static Atom atom_client_list, atom_net_wm_name, atom_utf8_string;
+// Monitors from XRandR, followed through RRScreenChangeNotify
+static struct catalog_monitor *catalog_monitors;
+static int catalog_nmonitors, rr_event_base = -1;
+
+// Windows being captured, their attributes are followed through StructureNotify events so that
+// the capture does not ask for them before every frame
+struct watch
+{
+    Window w;
+    XWindowAttributes wattr;
+    // Geometry or map state changed by an event before the attributes were read
+    int moved, mapped;
+    int refs, destroyed;
+    struct watch *next;
+};
+static struct watch *watches;
+// Held while a window is added or removed, after it the attributes of a watch are known
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void strcpysafechars(char *dst, const char *src)
+{
+    while (*src)
+    {
+        if (isalnum((unsigned char)*src))
+            *dst++ = *src;
+        else if (*src == ' ')
+            *dst++ = '_';
+        else
+            *dst++ = '.';
+        src++;
+    }
+    *dst = 0;
+}
+
+static unsigned hash_window(Window w)
+{
+    return (unsigned)((w ^ (w >> 16)) * 0x9e3779b1u);
+}
+
+static int *build_index(const struct catalog_item *items, int n, unsigned *mask)
+{
+    unsigned size = 16;
+    int *index;
+
+    while (size < 2 * (unsigned)n)
+        size *= 2;
+    index = (int *)malloc(sizeof(*index) * size);
+    memset(index, 0xff, sizeof(*index) * size);
+    *mask = size - 1;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned h = hash_window(items[i].window) & *mask;
+        while (index[h] >= 0)
+            h = (h + 1) & *mask;
+        index[h] = i;
+    }
+    return index;
+}
+
+// Return the position of the window in catalog_items or -1, catalog_mutex has to be held
+static int find_index(Window w)
+{
+    if (!catalog_index)
+        return -1;
+    for (unsigned h = hash_window(w) & catalog_index_mask; catalog_index[h] >= 0; h = (h + 1) & catalog_index_mask)
+        if (catalog_items[catalog_index[h]].window == w)
+            return catalog_index[h];
+    return -1;
+}
+
+// Fetch the window title, _NET_WM_NAME (UTF-8) first, then WM_NAME
+static void fetch_title(Window w, struct catalog_item *item)
+{
+    Atom actualType;
+    int format;
+    unsigned long numItems, bytesAfter;
+    unsigned char *data = 0;
+    char *windowName = 0;
+
+    *item->title = 0;
+    if (XGetWindowProperty(catalog_display, w, atom_net_wm_name, 0L, sizeof(item->title) / 4, 0, atom_utf8_string,
+                           &actualType, &format, &numItems, &bytesAfter, &data) == Success &&
+        data && format == 8 && numItems)
+    {
+        snprintf(item->title, sizeof(item->title), "%s", (char *)data);
+    }
+    else if (XFetchName(catalog_display, w, &windowName) && windowName)
+    {
+        snprintf(item->title, sizeof(item->title), "%s", windowName);
+        XFree(windowName);
+    }
+    if (data)
+        XFree(data);
+    strcpysafechars(item->safename, item->title);
+}
+
+// catalog_mutex has to be held
+static struct watch *find_watch(Window w)
+{
+    struct watch *e;
+
+    for (e = watches; e && e->w != w; e = e->next)
+        ;
+    return e;
+}
+
+// Events selected on a window of the catalog or a watched one
+static long window_mask(Window w)
+{
+    long mask = PropertyChangeMask;
+
+    pthread_mutex_lock(&catalog_mutex);
+    if (find_watch(w))
+        mask |= StructureNotifyMask;
+    pthread_mutex_unlock(&catalog_mutex);
+    return mask;
+}
+
+// Rebuild the list from _NET_CLIENT_LIST, fetching titles only for new windows
+static void catalog_refresh()
+{
+    Atom actualType;
+    int format;
+    unsigned long numItems = 0;
+    unsigned long bytesAfter;
+    unsigned char *data = 0;
+    Window *list;
+    struct catalog_item *items;
+    int *index;
+    unsigned mask;
+    int n = 0, changed;
+
+    int status = XGetWindowProperty(catalog_display, catalog_root, atom_client_list, 0L, (~0L), 0, XA_WINDOW,
+                                    &actualType, &format, &numItems, &bytesAfter, &data);
+    if (status != Success || format != 32)
+        numItems = 0;
+    list = (Window *)data;
+
+    items = (struct catalog_item *)malloc(sizeof(*items) * (numItems + 1));
+    items[n].window = catalog_root;
+    strcpy(items[n].title, "Desktop");
+    strcpy(items[n].safename, "Desktop");
+    n++;
+    for (unsigned long i = 0; i < numItems; i++)
+    {
+        int j;
+
+        if (list[i] == catalog_root)
+            continue;
+        pthread_mutex_lock(&catalog_mutex);
+        j = find_index(list[i]);
+        if (j >= 0)
+            items[n] = catalog_items[j];
+        pthread_mutex_unlock(&catalog_mutex);
+        if (j < 0)
+        {
+            XSelectInput(catalog_display, list[i], window_mask(list[i]));
+            items[n].window = list[i];
+            fetch_title(list[i], &items[n]);
+        }
+        n++;
+    }
+    if (data)
+        XFree(data);
+    index = build_index(items, n, &mask);
+
+    pthread_mutex_lock(&catalog_mutex);
+    changed = n != catalog_nitems;
+    for (int i = 0; !changed && i < n; i++)
+        changed = items[i].window != catalog_items[i].window;
+    if (changed)
+        catalog_update_id++;
+    free(catalog_items);
+    free(catalog_index);
+    catalog_items = items;
+    catalog_nitems = n;
+    catalog_index = index;
+    catalog_index_mask = mask;
+    pthread_mutex_unlock(&catalog_mutex);
+    if (changed && catalog_listener)
+        catalog_listener();
+}
+
+static void catalog_update_title(Window w)
+{
+    struct catalog_item item;
+    int i, changed = 0;
+
+    fetch_title(w, &item);
+    pthread_mutex_lock(&catalog_mutex);
+    i = find_index(w);
+    if (i > 0 && strcmp(catalog_items[i].title, item.title))
+    {
+        strcpy(catalog_items[i].title, item.title);
+        strcpy(catalog_items[i].safename, item.safename);
+        catalog_update_id++;
+        changed = 1;
+    }
+    pthread_mutex_unlock(&catalog_mutex);
+    if (changed && catalog_listener)
+        catalog_listener();
+}
+
+static void catalog_refresh_monitors()
+{
+    XRRMonitorInfo *info;
+    struct catalog_monitor *monitors;
+    int n = 0, changed;
+
+    info = XRRGetMonitors(catalog_display, catalog_root, True, &n);
+    monitors = (struct catalog_monitor *)calloc(n + 1, sizeof(*monitors));
+    for (int i = 0; i < n; i++)
+    {
+        char *name = XGetAtomName(catalog_display, info[i].name);
+
+        snprintf(monitors[i].name, sizeof(monitors[i].name), "%s", name ? name : "");
+        if (name)
+            XFree(name);
+        monitors[i].x = info[i].x;
+        monitors[i].y = info[i].y;
+        monitors[i].width = info[i].width;
+        monitors[i].height = info[i].height;
+    }
+    if (info)
+        XRRFreeMonitors(info);
+
+    pthread_mutex_lock(&catalog_mutex);
+    changed = n != catalog_nmonitors || (n && memcmp(monitors, catalog_monitors, sizeof(*monitors) * n));
+    if (changed)
+        catalog_update_id++;
+    free(catalog_monitors);
+    catalog_monitors = monitors;
+    catalog_nmonitors = n;
+    pthread_mutex_unlock(&catalog_mutex);
+    if (changed && catalog_listener)
+        catalog_listener();
+}
+
+static void catalog_window_event(const XEvent *ev)
+{
+    struct watch *e;
+
+    pthread_mutex_lock(&catalog_mutex);
+    e = find_watch(ev->xany.window);
+    if (e && ev->type == ConfigureNotify)
+    {
+        e->wattr.x = ev->xconfigure.x;
+        e->wattr.y = ev->xconfigure.y;
+        e->wattr.width = ev->xconfigure.width;
+        e->wattr.height = ev->xconfigure.height;
+        e->wattr.border_width = ev->xconfigure.border_width;
+        e->moved = 1;
+    }
+    else if (e && (ev->type == MapNotify || ev->type == UnmapNotify))
+    {
+        e->wattr.map_state = ev->type == MapNotify ? IsViewable : IsUnmapped;
+        e->mapped = 1;
+    }
+    else if (e && ev->type == DestroyNotify)
+        e->destroyed = 1;
+    pthread_mutex_unlock(&catalog_mutex);
+}
+
+static void *catalog_thread(void *arg)
+{
+    XEvent ev;
+
+    for (;;)
+    {
+        XNextEvent(catalog_display, &ev);
+        if (rr_event_base >= 0 && ev.type == rr_event_base + RRScreenChangeNotify)
+        {
+            XRRUpdateConfiguration(&ev);
+            catalog_refresh_monitors();
+            continue;
+        }
+        if (ev.type == ConfigureNotify || ev.type == MapNotify || ev.type == UnmapNotify || ev.type == DestroyNotify)
+        {
+            catalog_window_event(&ev);
+            continue;
+        }
+        if (ev.type != PropertyNotify)
+            continue;
+        if (ev.xproperty.window == catalog_root)
+        {
+            if (ev.xproperty.atom == atom_client_list)
+                catalog_refresh();
+        }
+        else if (ev.xproperty.atom == atom_net_wm_name || ev.xproperty.atom == XA_WM_NAME)
+            catalog_update_title(ev.xproperty.window);
+    }
+    return 0;
+}
+
+// The listener is called from the catalog thread after every change
+int catalog_start(void (*listener)())
+{
+    pthread_t thread;
+    int error_base;
+
+    catalog_listener = listener;
+    catalog_display = xconn_events();
+    if (!catalog_display)
+        return -1;
+    catalog_root = RootWindow(catalog_display, DefaultScreen(catalog_display));
+    atom_client_list = XInternAtom(catalog_display, "_NET_CLIENT_LIST", 0);
+    atom_net_wm_name = XInternAtom(catalog_display, "_NET_WM_NAME", 0);
+    atom_utf8_string = XInternAtom(catalog_display, "UTF8_STRING", 0);
+    XSelectInput(catalog_display, catalog_root, PropertyChangeMask);
+    catalog_refresh();
+    if (XRRQueryExtension(catalog_display, &rr_event_base, &error_base))
+    {
+        XRRSelectInput(catalog_display, catalog_root, RRScreenChangeNotifyMask);
+        catalog_refresh_monitors();
+    }
+    else
+        rr_event_base = -1;
+    if (pthread_create(&thread, NULL, catalog_thread, 0) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Return a copy of the catalog, the caller has to free it
+int catalog_get_items(struct catalog_item **items, unsigned *update_id)
+{
+    int n;
+
+    pthread_mutex_lock(&catalog_mutex);
+    n = catalog_nitems;
+    if (update_id)
+        *update_id = catalog_update_id;
+    *items = (struct catalog_item *)malloc(sizeof(**items) * (n + 1));
+    memcpy(*items, catalog_items, sizeof(**items) * n);
+    pthread_mutex_unlock(&catalog_mutex);
+    return n;
+}
+
+unsigned catalog_get_update_id()
+{
+    unsigned update_id;
+
+    pthread_mutex_lock(&catalog_mutex);
+    update_id = catalog_update_id;
+    pthread_mutex_unlock(&catalog_mutex);
+    return update_id;
+}
+
+// Find a window by its ID, the title is returned in item
+int catalog_lookup(Window w, struct catalog_item *item)
+{
+    int i;
+
+    pthread_mutex_lock(&catalog_mutex);
+    i = find_index(w);
+    if (i >= 0)
+        *item = catalog_items[i];
+    pthread_mutex_unlock(&catalog_mutex);
+    return i >= 0 ? 0 : -1;
+}
+
+// Find a window by its sanitized title, used for URLs without the window ID
+Window catalog_find(const char *safename)
+{
+    Window w = 0;
+
+    pthread_mutex_lock(&catalog_mutex);
+    for (int i = 0; i < catalog_nitems; i++)
+        if (!strcmp(catalog_items[i].safename, safename))
+        {
+            w = catalog_items[i].window;
+            break;
+        }
+    pthread_mutex_unlock(&catalog_mutex);
+    return w;
+}
+
+// Return a copy of the monitor list, the caller has to free it
+int catalog_get_monitors(struct catalog_monitor **monitors)
+{
+    int n;
+
+    pthread_mutex_lock(&catalog_mutex);
+    n = catalog_nmonitors;
+    *monitors = (struct catalog_monitor *)malloc(sizeof(**monitors) * (n + 1));
+    memcpy(*monitors, catalog_monitors, sizeof(**monitors) * n);
+    pthread_mutex_unlock(&catalog_mutex);
+    return n;
+}
+
+// Follow the attributes of a window until catalog_unwatch, returns -1 if the window is gone
+int catalog_watch(Window w)
+{
+    struct watch *e;
+    XWindowAttributes wattr;
+    int ok;
+
+    pthread_mutex_lock(&watch_mutex);
+    pthread_mutex_lock(&catalog_mutex);
+    e = find_watch(w);
+    if (e)
+    {
+        e->refs++;
+        ok = !e->destroyed;
+        pthread_mutex_unlock(&catalog_mutex);
+        pthread_mutex_unlock(&watch_mutex);
+        return ok ? 0 : -1;
+    }
+    e = (struct watch *)calloc(1, sizeof(*e));
+    e->w = w;
+    e->refs = 1;
+    e->next = watches;
+    watches = e;
+    pthread_mutex_unlock(&catalog_mutex);
+
+    // The events come after the selection, so the attributes are read after it and an event
+    // that arrives before them is newer
+    XSelectInput(catalog_display, w, window_mask(w));
+    ok = XGetWindowAttributes(catalog_display, w, &wattr);
+    pthread_mutex_lock(&catalog_mutex);
+    if (!ok)
+        e->destroyed = 1;
+    else
+    {
+        if (e->moved)
+        {
+            wattr.x = e->wattr.x;
+            wattr.y = e->wattr.y;
+            wattr.width = e->wattr.width;
+            wattr.height = e->wattr.height;
+            wattr.border_width = e->wattr.border_width;
+        }
+        if (e->mapped)
+            wattr.map_state = e->wattr.map_state;
+        e->wattr = wattr;
+    }
+    ok = !e->destroyed;
+    pthread_mutex_unlock(&catalog_mutex);
+    pthread_mutex_unlock(&watch_mutex);
+    return ok ? 0 : -1;
+}
+
+// The last known attributes of a watched window, -1 when it was destroyed
+int catalog_geometry(Window w, XWindowAttributes *wattr)
+{
+    struct watch *e;
+    int ret = -1;
+
+    pthread_mutex_lock(&catalog_mutex);
+    e = find_watch(w);
+    if (e && !e->destroyed)
+    {
+        *wattr = e->wattr;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&catalog_mutex);
+    return ret;
+}
+
+void catalog_unwatch(Window w)
+{
+    struct watch **p, *e = 0;
+
+    pthread_mutex_lock(&watch_mutex);
+    pthread_mutex_lock(&catalog_mutex);
+    for (p = &watches; *p; p = &(*p)->next)
+        if ((*p)->w == w)
+        {
+            if (!--(*p)->refs)
+            {
+                e = *p;
+                *p = e->next;
+            }
+            break;
+        }
+    pthread_mutex_unlock(&catalog_mutex);
+    if (e && !e->destroyed)
+        XSelectInput(catalog_display, w, PropertyChangeMask);
+    pthread_mutex_unlock(&watch_mutex);
+    free(e);
+}
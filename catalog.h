@@ -0,0 +1,40 @@
+#ifndef _CATALOG_H_INCLUDED_
+#define _CATALOG_H_INCLUDED_
+
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    struct catalog_item
+    {
+        Window window;
+        char title[256];
+        char safename[256];
+    };
+
+    // Monitor rectangle in the root window
+    struct catalog_monitor
+    {
+        char name[64];
+        int x, y, width, height;
+    };
+
+    int catalog_start(void (*listener)());
+    int catalog_get_items(struct catalog_item **items, unsigned *update_id);
+    unsigned catalog_get_update_id();
+    int catalog_lookup(Window w, struct catalog_item *item);
+    Window catalog_find(const char *safename);
+    int catalog_get_monitors(struct catalog_monitor **monitors);
+    int catalog_watch(Window w);
+    int catalog_geometry(Window w, XWindowAttributes *wattr);
+    void catalog_unwatch(Window w);
+    void strcpysafechars(char *dst, const char *src);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
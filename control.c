@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "control.h"
+#include "http.h"
+
+#define MAX_STATUS 65536
+
+// Value of a key in a flat JSON object, null when the key is missing
+static const char *json_value(const char *json, const char *key)
+{
+    char name[40];
+    int len = snprintf(name, sizeof(name), "\"%s\"", key);
+
+    for (const char *p = json; (p = strstr(p, name));)
+    {
+        p += len;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p++ != ':')
+            continue;
+        while (isspace((unsigned char)*p))
+            p++;
+        return p;
+    }
+    return 0;
+}
+
+// Numbers and booleans, true is 1 and false 0
+static void json_int(const char *json, const char *key, int *value)
+{
+    const char *p = json_value(json, key);
+
+    if (!p)
+        return;
+    if (!strncmp(p, "true", 4))
+        *value = 1;
+    else if (!strncmp(p, "false", 5))
+        *value = 0;
+    else if (*p == '-' || isdigit((unsigned char)*p))
+        *value = atoi(p);
+}
+
+// Strings without escapes
+static void json_string(const char *json, const char *key, char *value, int size)
+{
+    const char *p = json_value(json, key), *end;
+
+    if (!p || *p++ != '"' || !(end = strchr(p, '"')) || end - p >= size)
+        return;
+    memcpy(value, p, end - p);
+    value[end - p] = 0;
+}
+
+// GET /control lists the sessions, POST /control with an object like
+// {"session": 2, "bitrate": 1000000, "preset": "veryfast"} changes them
+int control_handle_request(int sk, const struct http_request *req)
+{
+    struct control_change change = {0, 0, 0, 0, 0, -1, ""};
+    char *status;
+    int len, ret = 0;
+
+    if (!strcmp(req->method, "POST"))
+    {
+        const char *body = req->body ? req->body : "";
+
+        if (!strchr(body, '{'))
+            return http_send_response(sk, req, 400, 0, 0, 0, 0);
+        json_int(body, "session", &change.session);
+        json_int(body, "width", &change.width);
+        json_int(body, "height", &change.height);
+        json_int(body, "fps", &change.fps);
+        json_int(body, "bitrate", &change.bitrate);
+        json_int(body, "audio", &change.audio);
+        json_string(body, "preset", change.preset, sizeof(change.preset));
+        ret = control_apply(&change);
+        if (ret < 0)
+            return http_send_response(sk, req, ret == -1 ? 404 : 400, 0, 0, 0, 0);
+    }
+    status = (char *)malloc(MAX_STATUS);
+    len = control_status(status, MAX_STATUS);
+    ret = http_send_response(sk, req, 200, "application/json", status, len, 0);
+    free(status);
+    return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef _CONTROL_H_INCLUDED_
+#define _CONTROL_H_INCLUDED_
+
+#include <stddef.h>
+#include "http.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Settings changed by a control request
+    struct control_change
+    {
+        // Session to change, 0 for all of them and the defaults of new ones
+        int session;
+        // New values, 0 or an empty preset for the ones left as they are, audio -1
+        int width, height, fps, bitrate, audio;
+        // An x264 preset, or auto to let the encoder choose
+        char preset[16];
+    };
+
+    int control_handle_request(int sk, const struct http_request *req);
+
+    // Provided by screencast.c, the status is written as JSON, changes return -1 for an unknown
+    // session and -2 for invalid values
+    int control_status(char *buf, size_t size);
+    int control_apply(const struct control_change *change);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
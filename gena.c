@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ssdp.h"
+#include "gena.h"
+
+#define MAX_SUBSCRIPTIONS 32
+#define DEFAULT_TIMEOUT 1800
+// SystemUpdateID is a moderated variable, evented at most every 2 seconds
+#define EVENT_INTERVAL 2
+
+const char *event_template =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\r\n"
+    "  <e:property>\r\n"
+    "    <SystemUpdateID>%u</SystemUpdateID>\r\n"
+    "  </e:property>\r\n"
+    "</e:propertyset>\r\n";
+
+const char *connection_manager_event =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\r\n"
+    "  <e:property>\r\n"
+    "    <SourceProtocolInfo>http-get:*:video/MP2T:*</SourceProtocolInfo>\r\n"
+    "  </e:property>\r\n"
+    "  <e:property>\r\n"
+    "    <SinkProtocolInfo></SinkProtocolInfo>\r\n"
+    "  </e:property>\r\n"
+    "  <e:property>\r\n"
+    "    <CurrentConnectionIDs>0</CurrentConnectionIDs>\r\n"
+    "  </e:property>\r\n"
+    "</e:propertyset>\r\n";
+
+const char *notify_event_template =
+    "NOTIFY %s HTTP/1.1\r\n"
+    "HOST: %s\r\n"
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+    "CONTENT-LENGTH: %zu\r\n"
+    "NT: upnp:event\r\n"
+    "NTS: upnp:propchange\r\n"
+    "SID: %s\r\n"
+    "SEQ: %u\r\n"
+    "Connection: close\r\n\r\n"
+    "%s";
+
+struct subscription
+{
+    char sid[50];
+    int service;
+    struct sockaddr_in addr;
+    char host[30], path[256];
+    time_t expires, next_event;
+    unsigned seq, update_id;
+    // Events are only sent after the SUBSCRIBE response went out
+    int active;
+};
+
+static struct subscription subs[MAX_SUBSCRIPTIONS];
+static pthread_mutex_t gena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gena_cond = PTHREAD_COND_INITIALIZER;
+
+// Parse the first URL of a CALLBACK header like <http://192.168.1.2:49152/event>
+static int parse_callback(const char *callback, struct subscription *sub)
+{
+    char ip[20];
+    const char *p = strstr(callback, "<http://"), *q;
+    int port = 80;
+
+    if (!p)
+        return -1;
+    p += 8;
+    for (q = p; *q && *q != ':' && *q != '/' && *q != '>'; q++)
+        ;
+    if (q - p >= sizeof(ip))
+        return -1;
+    memcpy(ip, p, q - p);
+    ip[q - p] = 0;
+    if (*q == ':')
+        port = strtol(q + 1, (char **)&q, 10);
+    memset(&sub->addr, 0, sizeof(sub->addr));
+    sub->addr.sin_family = AF_INET;
+    sub->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &sub->addr.sin_addr) != 1)
+        return -1;
+    snprintf(sub->host, sizeof(sub->host), "%s:%d", ip, port);
+    if (*q == '/')
+    {
+        p = q;
+        q = strchr(p, '>');
+        if (!q || q - p >= sizeof(sub->path))
+            return -1;
+        memcpy(sub->path, p, q - p);
+        sub->path[q - p] = 0;
+    }
+    else
+        strcpy(sub->path, "/");
+    return 0;
+}
+
+// TIMEOUT is Second-<n> or Second-infinite
+static int parse_timeout(const char *timeout)
+{
+    int seconds = 0;
+
+    if (timeout && !strncasecmp(timeout, "Second-", 7))
+        seconds = atoi(timeout + 7);
+    return seconds > 0 ? seconds : DEFAULT_TIMEOUT;
+}
+
+static struct subscription *find_subscription(const char *sid)
+{
+    time_t now = time(0);
+
+    for (int i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        if (*subs[i].sid && subs[i].expires >= now && !strcmp(subs[i].sid, sid))
+            return &subs[i];
+    return 0;
+}
+
+// Returns the HTTP status code for the SUBSCRIBE response
+int gena_subscribe(int service, const char *callback, const char *timeout, char *sid, int *seconds)
+{
+    static unsigned counter;
+    struct subscription sub, *slot = 0;
+    time_t now = time(0);
+
+    memset(&sub, 0, sizeof(sub));
+    sub.service = service;
+    if (parse_callback(callback, &sub))
+        return 412;
+    *seconds = parse_timeout(timeout);
+    pthread_mutex_lock(&gena_mutex);
+    for (int i = 0; i < MAX_SUBSCRIPTIONS && !slot; i++)
+        if (!*subs[i].sid || subs[i].expires < now)
+            slot = &subs[i];
+    if (!slot)
+    {
+        pthread_mutex_unlock(&gena_mutex);
+        return 500;
+    }
+    snprintf(sub.sid, sizeof(sub.sid), "uuid:%08x-%04x-4%03x-a%03x-%012x",
+             (unsigned)rand(), ++counter & 0xffff, (unsigned)rand() & 0xfff, (unsigned)rand() & 0xfff, (unsigned)now);
+    sub.expires = now + *seconds;
+    *slot = sub;
+    strcpy(sid, sub.sid);
+    pthread_mutex_unlock(&gena_mutex);
+    return 200;
+}
+
+int gena_renew(const char *sid, const char *timeout, int *seconds)
+{
+    struct subscription *sub;
+
+    *seconds = parse_timeout(timeout);
+    pthread_mutex_lock(&gena_mutex);
+    sub = find_subscription(sid);
+    if (sub)
+        sub->expires = time(0) + *seconds;
+    pthread_mutex_unlock(&gena_mutex);
+    return sub ? 200 : 412;
+}
+
+int gena_unsubscribe(const char *sid)
+{
+    struct subscription *sub;
+
+    pthread_mutex_lock(&gena_mutex);
+    sub = find_subscription(sid);
+    if (sub)
+        *sub->sid = 0;
+    pthread_mutex_unlock(&gena_mutex);
+    return sub ? 200 : 412;
+}
+
+void gena_send_initial(const char *sid)
+{
+    struct subscription *sub;
+
+    pthread_mutex_lock(&gena_mutex);
+    sub = find_subscription(sid);
+    if (sub)
+    {
+        sub->active = 1;
+        pthread_cond_signal(&gena_cond);
+    }
+    pthread_mutex_unlock(&gena_mutex);
+}
+
+// Called when SystemUpdateID changed
+void gena_wakeup()
+{
+    pthread_mutex_lock(&gena_mutex);
+    pthread_cond_signal(&gena_cond);
+    pthread_mutex_unlock(&gena_mutex);
+}
+
+static void send_event(const struct subscription *sub, unsigned seq, unsigned update_id)
+{
+    char body[600], msg[1200];
+    struct timeval tv = {2, 0};
+    int sk, rc;
+
+    if (sub->service == GENA_CONNECTION_MANAGER)
+        snprintf(body, sizeof(body), "%s", connection_manager_event);
+    else
+        snprintf(body, sizeof(body), event_template, update_id);
+    snprintf(msg, sizeof(msg), notify_event_template, sub->path, sub->host, strlen(body), sub->sid, seq, body);
+    sk = socket(AF_INET, SOCK_STREAM, 0);
+    if (sk < 0)
+        return;
+    setsockopt(sk, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(sk, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(sk, (struct sockaddr *)&sub->addr, sizeof(sub->addr)) < 0)
+    {
+        fprintf(stderr, "Cannot send event to %s\n", sub->host);
+        close(sk);
+        return;
+    }
+    rc = write(sk, msg, strlen(msg));
+    // Wait for the reply, its content does not matter
+    rc = read(sk, msg, sizeof(msg));
+    (void)rc;
+    close(sk);
+}
+
+static void *gena_thread(void *arg)
+{
+    pthread_mutex_lock(&gena_mutex);
+    for (;;)
+    {
+        struct subscription sub;
+        struct timespec ts;
+        time_t now = time(0), wakeup = now + 60;
+        unsigned update_id = get_system_update_id(), seq = 0;
+        int found = 0;
+
+        for (int i = 0; i < MAX_SUBSCRIPTIONS && !found; i++)
+        {
+            struct subscription *s = &subs[i];
+
+            if (!*s->sid || !s->active)
+                continue;
+            if (s->expires < now)
+            {
+                *s->sid = 0;
+                continue;
+            }
+            // The initial event has SEQ 0 and is sent immediately
+            if (s->seq && (s->service == GENA_CONNECTION_MANAGER || s->update_id == update_id))
+                continue;
+            if (s->seq && s->next_event > now)
+            {
+                if (s->next_event < wakeup)
+                    wakeup = s->next_event;
+                continue;
+            }
+            seq = s->seq++;
+            s->update_id = update_id;
+            s->next_event = now + EVENT_INTERVAL;
+            sub = *s;
+            found = 1;
+        }
+        if (found)
+        {
+            pthread_mutex_unlock(&gena_mutex);
+            send_event(&sub, seq, update_id);
+            pthread_mutex_lock(&gena_mutex);
+            continue;
+        }
+        ts.tv_sec = wakeup;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&gena_cond, &gena_mutex, &ts);
+    }
+    return 0;
+}
+
+int gena_start()
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, gena_thread, 0) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _GENA_H_INCLUDED_
+#define _GENA_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Evented services, the ConnectionManager only gets the initial event, its variables do not change
+#define GENA_CONTENT_DIRECTORY 0
+#define GENA_CONNECTION_MANAGER 1
+
+    int gena_start();
+    int gena_subscribe(int service, const char *callback, const char *timeout, char *sid, int *seconds);
+    int gena_renew(const char *sid, const char *timeout, int *seconds);
+    int gena_unsubscribe(const char *sid);
+    void gena_send_initial(const char *sid);
+    void gena_wakeup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
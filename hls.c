@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "hls.h"
+#include "http.h"
+
+// Complete segments kept in memory, the ring has one more slot for the segment being written
+#define HLS_SEGMENTS 6
+#define HLS_RING (HLS_SEGMENTS + 1)
+#define HLS_MAX_PARTS 16
+// Parts are listed in the playlist only for the last complete segments
+#define HLS_PART_SEGMENTS 2
+// The producer stops when nobody requested anything for this many seconds
+#define HLS_IDLE_TIMEOUT 30
+// Maximum time a blocking playlist or preload hint request waits
+#define HLS_WAIT 6
+
+// Parts are immutable once published and shared by all clients through a reference count
+struct hls_part
+{
+    int refs;
+    uint8_t *data;
+    size_t len, size;
+    double duration;
+    int independent;
+};
+
+struct hls_segment
+{
+    int nparts;
+    struct hls_part *parts[HLS_MAX_PARTS];
+    double duration;
+};
+
+struct hls_stream
+{
+    char name[300];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct hls_segment segments[HLS_RING];
+    // Oldest kept segment and segment being written
+    unsigned first_seq, cur_seq;
+    // The part being written is only accessed by the producer
+    struct hls_part *part;
+    int64_t segment_start, part_start;
+    int part_independent, started, stopped;
+    double last_access;
+    // Protected by hls_list_mutex
+    int users;
+    struct hls_stream *next;
+};
+
+static pthread_mutex_t hls_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hls_stream *hls_streams;
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void release_part(struct hls_part *part)
+{
+    if (--part->refs)
+        return;
+    free(part->data);
+    free(part);
+}
+
+static void release_segment(struct hls_segment *seg)
+{
+    for (int i = 0; i < seg->nparts; i++)
+        release_part(seg->parts[i]);
+    seg->nparts = 0;
+    seg->duration = 0;
+}
+
+static void put_stream(struct hls_stream *hls)
+{
+    pthread_mutex_lock(&hls_list_mutex);
+    if (--hls->users)
+    {
+        pthread_mutex_unlock(&hls_list_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&hls_list_mutex);
+    for (int i = 0; i < HLS_RING; i++)
+        release_segment(&hls->segments[i]);
+    if (hls->part)
+    {
+        free(hls->part->data);
+        free(hls->part);
+    }
+    pthread_mutex_destroy(&hls->mutex);
+    pthread_cond_destroy(&hls->cond);
+    free(hls);
+}
+
+static void *hls_thread(void *arg)
+{
+    struct hls_stream *hls = (struct hls_stream *)arg;
+    struct hls_stream **p;
+
+    serve_hls(hls->name, hls);
+    pthread_mutex_lock(&hls->mutex);
+    hls->stopped = 1;
+    pthread_cond_broadcast(&hls->cond);
+    pthread_mutex_unlock(&hls->mutex);
+    pthread_mutex_lock(&hls_list_mutex);
+    for (p = &hls_streams; *p; p = &(*p)->next)
+        if (*p == hls)
+        {
+            *p = hls->next;
+            break;
+        }
+    pthread_mutex_unlock(&hls_list_mutex);
+    put_stream(hls);
+    return 0;
+}
+
+// Find the stream of a source, starting its producer if create is set
+static struct hls_stream *get_stream(const char *name, int create)
+{
+    struct hls_stream *hls;
+    pthread_t thread;
+
+    pthread_mutex_lock(&hls_list_mutex);
+    for (hls = hls_streams; hls; hls = hls->next)
+        if (!strcmp(hls->name, name))
+            break;
+    if (!hls && create)
+    {
+        hls = (struct hls_stream *)calloc(1, sizeof(*hls));
+        snprintf(hls->name, sizeof(hls->name), "%s", name);
+        pthread_mutex_init(&hls->mutex, 0);
+        pthread_cond_init(&hls->cond, 0);
+        hls->last_access = now_seconds();
+        // One use for the producer, one for the caller
+        hls->users = 1;
+        if (pthread_create(&thread, NULL, hls_thread, hls) != 0)
+        {
+            perror("pthread_create");
+            pthread_mutex_unlock(&hls_list_mutex);
+            put_stream(hls);
+            return 0;
+        }
+        pthread_detach(thread);
+        hls->next = hls_streams;
+        hls_streams = hls;
+    }
+    if (hls)
+        hls->users++;
+    pthread_mutex_unlock(&hls_list_mutex);
+    return hls;
+}
+
+// Segment seq is complete or its part exists, hls->mutex has to be held. A complete segment
+// is available for any part, wait_available checks that the part exists
+static int available(struct hls_stream *hls, unsigned seq, int part)
+{
+    if (seq < hls->cur_seq)
+        return 1;
+    return seq == hls->cur_seq && part >= 0 && part < hls->segments[seq % HLS_RING].nparts;
+}
+
+static int wait_available(struct hls_stream *hls, unsigned seq, int part)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += HLS_WAIT;
+    while (!hls->stopped && !available(hls, seq, part))
+        if (pthread_cond_timedwait(&hls->cond, &hls->mutex, &ts) == ETIMEDOUT)
+            break;
+    if (!available(hls, seq, part))
+        return -1;
+    // Complete segments get no more parts, and the ones dropped meanwhile have none
+    return seq >= hls->first_seq && part < hls->segments[seq % HLS_RING].nparts ? 0 : -1;
+}
+
+// Build the low latency playlist, hls->mutex has to be held
+static char *build_playlist(struct hls_stream *hls, size_t *len)
+{
+    size_t size = 1024 + HLS_RING * (HLS_MAX_PARTS + 1) * 100;
+    char *buf = (char *)malloc(size), *p = buf;
+    struct hls_segment *seg;
+    int target = HLS_SEGMENT_DURATION;
+
+    for (unsigned seq = hls->first_seq; seq < hls->cur_seq; seq++)
+        if (hls->segments[seq % HLS_RING].duration > target)
+            target = (int)(hls->segments[seq % HLS_RING].duration + 0.999);
+    p += sprintf(p,
+                 "#EXTM3U\n"
+                 "#EXT-X-VERSION:6\n"
+                 "#EXT-X-TARGETDURATION:%d\n"
+                 "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n"
+                 "#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+                 "#EXT-X-MEDIA-SEQUENCE:%u\n",
+                 target, 3 * HLS_PART_DURATION, HLS_PART_DURATION, hls->first_seq);
+    for (unsigned seq = hls->first_seq; seq <= hls->cur_seq; seq++)
+    {
+        seg = &hls->segments[seq % HLS_RING];
+        if (seq + HLS_PART_SEGMENTS >= hls->cur_seq)
+            for (int i = 0; i < seg->nparts; i++)
+                p += sprintf(p, "#EXT-X-PART:DURATION=%.3f,URI=\"%u.%d.ts\"%s\n", seg->parts[i]->duration, seq, i,
+                             seg->parts[i]->independent ? ",INDEPENDENT=YES" : "");
+        if (seq < hls->cur_seq)
+            p += sprintf(p, "#EXTINF:%.3f,\n%u.ts\n", seg->duration, seq);
+        else
+            p += sprintf(p, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%u.%d.ts\"\n", seq, seg->nparts);
+    }
+    *len = p - buf;
+    return buf;
+}
+
+static void send_playlist(int sk, const struct http_request *req, struct hls_stream *hls, const char *query)
+{
+    const char *p;
+    size_t len;
+    char *playlist;
+    int msn = -1, part = -1;
+
+    // Blocking playlist reload waits for the requested segment or part
+    if (query && (p = strstr(query, "_HLS_msn=")))
+        msn = atoi(p + 9);
+    if (query && (p = strstr(query, "_HLS_part=")))
+        part = atoi(p + 10);
+    pthread_mutex_lock(&hls->mutex);
+    if (msn >= 0)
+        wait_available(hls, msn, part);
+    else if (hls->cur_seq == hls->first_seq)
+        wait_available(hls, hls->first_seq, -1);
+    if (hls->cur_seq == hls->first_seq)
+    {
+        pthread_mutex_unlock(&hls->mutex);
+        http_send_response(sk, req, 503, 0, 0, 0, 0);
+        return;
+    }
+    playlist = build_playlist(hls, &len);
+    pthread_mutex_unlock(&hls->mutex);
+    http_send_response(sk, req, 200, "application/vnd.apple.mpegurl", playlist, len, "Cache-Control: no-cache\r\n");
+    free(playlist);
+}
+
+// Send a whole segment (part < 0) or a single part, the parts are written without copying
+static void send_media(int sk, const struct http_request *req, struct hls_stream *hls, unsigned seq, int part)
+{
+    struct hls_part *parts[HLS_MAX_PARTS];
+    struct iovec iov[HLS_MAX_PARTS + 1];
+    struct hls_segment *seg;
+    char headers[300];
+    size_t len = 0;
+    int n = 0;
+
+    pthread_mutex_lock(&hls->mutex);
+    if (seq < hls->first_seq || wait_available(hls, seq, part))
+    {
+        pthread_mutex_unlock(&hls->mutex);
+        http_send_response(sk, req, 404, 0, 0, 0, 0);
+        return;
+    }
+    seg = &hls->segments[seq % HLS_RING];
+    for (int i = part < 0 ? 0 : part; i < (part < 0 ? seg->nparts : part + 1); i++)
+    {
+        parts[n] = seg->parts[i];
+        parts[n]->refs++;
+        iov[n + 1].iov_base = parts[n]->data;
+        iov[n + 1].iov_len = parts[n]->len;
+        len += parts[n]->len;
+        n++;
+    }
+    pthread_mutex_unlock(&hls->mutex);
+
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: video/MP2T\r\n"
+             "Content-Length: %zu\r\n"
+             "Cache-Control: max-age=60\r\n"
+             "Connection: %s\r\n\r\n",
+             len, req->keep_alive ? "keep-alive" : "close");
+    iov[0].iov_base = headers;
+    iov[0].iov_len = strlen(headers);
+    http_writev(sk, iov, req->head ? 1 : n + 1);
+
+    pthread_mutex_lock(&hls->mutex);
+    for (int i = 0; i < n; i++)
+        release_part(parts[i]);
+    pthread_mutex_unlock(&hls->mutex);
+}
+
+// Handle /hls/<source>/index.m3u8, /hls/<source>/<seq>.ts and /hls/<source>/<seq>.<part>.ts
+int hls_handle_request(int sk, const struct http_request *req)
+{
+    char name[300], file[100], *query;
+    const char *p = req->path + 5, *q = strrchr(p, '/');
+    struct hls_stream *hls;
+    unsigned seq;
+    int part, playlist;
+
+    if (!q || q == p || q - p >= sizeof(name) || strlen(q + 1) >= sizeof(file))
+        return http_send_response(sk, req, 404, 0, 0, 0, 0);
+    memcpy(name, p, q - p);
+    name[q - p] = 0;
+    strcpy(file, q + 1);
+    query = strchr(file, '?');
+    if (query)
+        *query++ = 0;
+    playlist = !strcmp(file, "index.m3u8");
+    hls = get_stream(name, playlist);
+    if (!hls)
+        return http_send_response(sk, req, 404, 0, 0, 0, 0);
+    pthread_mutex_lock(&hls->mutex);
+    hls->last_access = now_seconds();
+    pthread_mutex_unlock(&hls->mutex);
+    if (playlist)
+        send_playlist(sk, req, hls, query);
+    else if (sscanf(file, "%u.%d.ts", &seq, &part) == 2 && part >= 0 && part < HLS_MAX_PARTS)
+        send_media(sk, req, hls, seq, part);
+    else if (sscanf(file, "%u.ts", &seq) == 1)
+        send_media(sk, req, hls, seq, -1);
+    else
+        http_send_response(sk, req, 404, 0, 0, 0, 0);
+    put_stream(hls);
+    return 0;
+}
+
+// Muxer output, appends to the part being written
+int hls_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct hls_stream *hls = (struct hls_stream *)opaque;
+    struct hls_part *part = hls->part;
+
+    if (!part)
+        part = hls->part = (struct hls_part *)calloc(1, sizeof(*part));
+    if (part->len + buf_size > part->size)
+    {
+        part->size = part->size * 2 > part->len + buf_size ? part->size * 2 : part->len + buf_size + 65536;
+        part->data = (uint8_t *)realloc(part->data, part->size);
+    }
+    memcpy(part->data + part->len, buf, buf_size);
+    part->len += buf_size;
+    return buf_size;
+}
+
+// Publish the part being written, hls->mutex has to be held
+static void close_part(struct hls_stream *hls, struct hls_segment *seg, double duration)
+{
+    struct hls_part *part = hls->part;
+
+    if (!part)
+        part = (struct hls_part *)calloc(1, sizeof(*part));
+    part->refs = 1;
+    part->duration = duration;
+    part->independent = hls->part_independent;
+    seg->parts[seg->nparts++] = part;
+    hls->part = 0;
+}
+
+// Called with the muxer flushed before every video packet, cuts parts and segments
+void hls_packet(void *opaque, int key, int64_t pts)
+{
+    struct hls_stream *hls = (struct hls_stream *)opaque;
+    struct hls_segment *seg;
+    double segment_duration = (pts - hls->segment_start) / 90000.0, part_duration = (pts - hls->part_start) / 90000.0;
+
+    if (!hls->started)
+    {
+        hls->started = 1;
+        hls->segment_start = hls->part_start = pts;
+        hls->part_independent = key;
+        return;
+    }
+    pthread_mutex_lock(&hls->mutex);
+    seg = &hls->segments[hls->cur_seq % HLS_RING];
+    // Keyframes come on time, but on the capture clock, which is a little off now and then
+    if (key && segment_duration >= HLS_SEGMENT_DURATION - HLS_PART_DURATION / 2)
+    {
+        close_part(hls, seg, part_duration);
+        seg->duration = segment_duration;
+        hls->cur_seq++;
+        if (hls->cur_seq - hls->first_seq > HLS_SEGMENTS)
+            release_segment(&hls->segments[hls->first_seq++ % HLS_RING]);
+        hls->segment_start = pts;
+    }
+    // Every segment starts with a keyframe, so the last part a segment has room for runs to the
+    // next one, however long static content makes it
+    else if (part_duration >= HLS_PART_DURATION && seg->nparts < HLS_MAX_PARTS - 1)
+        close_part(hls, seg, part_duration);
+    else
+    {
+        pthread_mutex_unlock(&hls->mutex);
+        return;
+    }
+    hls->part_start = pts;
+    hls->part_independent = key;
+    pthread_cond_broadcast(&hls->cond);
+    pthread_mutex_unlock(&hls->mutex);
+}
+
+int hls_idle(void *opaque)
+{
+    struct hls_stream *hls = (struct hls_stream *)opaque;
+    int idle;
+
+    pthread_mutex_lock(&hls->mutex);
+    idle = now_seconds() - hls->last_access > HLS_IDLE_TIMEOUT;
+    pthread_mutex_unlock(&hls->mutex);
+    return idle;
+}
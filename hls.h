@@ -0,0 +1,30 @@
+#ifndef _HLS_H_INCLUDED_
+#define _HLS_H_INCLUDED_
+
+#include <stdint.h>
+#include "http.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Segment and part durations in seconds, segments start with a forced keyframe
+#define HLS_SEGMENT_DURATION 2
+#define HLS_PART_DURATION 0.5
+
+    struct hls_stream;
+
+    int hls_handle_request(int sk, const struct http_request *req);
+    int hls_write(void *opaque, uint8_t *buf, int buf_size);
+    void hls_packet(void *opaque, int key, int64_t pts);
+    int hls_idle(void *opaque);
+
+    // Provided by screencast.c, encodes the named source into the stream until hls_idle returns nonzero
+    int serve_hls(const char *name, struct hls_stream *hls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
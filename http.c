@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "http.h"
+
+#define HTTP_MAX_HEADERS 16384
+#define HTTP_MAX_BODY 262144
+
+void http_conn_init(struct http_conn *conn, int sk)
+{
+    conn->sk = sk;
+    conn->size = 4096;
+    conn->buf = (char *)malloc(conn->size);
+    conn->len = 0;
+}
+
+void http_conn_free(struct http_conn *conn)
+{
+    free(conn->buf);
+    conn->buf = 0;
+}
+
+void http_request_free(struct http_request *req)
+{
+    free(req->headers);
+    free(req->body);
+    req->headers = req->body = 0;
+}
+
+// Make room for at least need bytes in the connection buffer
+static void reserve(struct http_conn *conn, int need)
+{
+    if (need <= conn->size)
+        return;
+    while (conn->size < need)
+        conn->size *= 2;
+    conn->buf = (char *)realloc(conn->buf, conn->size);
+}
+
+static int receive(struct http_conn *conn)
+{
+    ssize_t n;
+
+    if (conn->len == conn->size)
+        reserve(conn, conn->size + 1);
+    do
+        n = read(conn->sk, conn->buf + conn->len, conn->size - conn->len);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    conn->len += n;
+    return 0;
+}
+
+// Read the next request from the connection, data following it is kept for the next call
+// Returns 0 on success, -1 when the connection was closed or an HTTP error status
+int http_read_request(struct http_conn *conn, struct http_request *req)
+{
+    char *end = 0, *line_end, value[30], version[10];
+    int scanned = 0, hdrlen;
+
+    memset(req, 0, sizeof(*req));
+    for (;;)
+    {
+        // Empty lines before a request are ignored
+        while (conn->len >= 2 && conn->buf[0] == '\r' && conn->buf[1] == '\n')
+        {
+            memmove(conn->buf, conn->buf + 2, conn->len - 2);
+            conn->len -= 2;
+            scanned = 0;
+        }
+        for (int i = scanned > 3 ? scanned - 3 : 0; i + 4 <= conn->len; i++)
+            if (!memcmp(conn->buf + i, "\r\n\r\n", 4))
+            {
+                end = conn->buf + i;
+                break;
+            }
+        if (end)
+            break;
+        scanned = conn->len;
+        if (conn->len >= HTTP_MAX_HEADERS)
+            return 431;
+        if (receive(conn))
+            return -1;
+    }
+    hdrlen = end + 4 - conn->buf;
+    line_end = memchr(conn->buf, '\r', hdrlen);
+    *line_end = 0;
+    if (sscanf(conn->buf, "%15s %1023s %9s", req->method, req->path, version) != 3 || strncmp(version, "HTTP/1.", 7))
+        return 400;
+    *line_end = '\r';
+    req->version = version[7] == '0' ? 10 : 11;
+    req->head = !strcmp(req->method, "HEAD");
+    req->headers = (char *)malloc(end + 4 - line_end + 1);
+    memcpy(req->headers, line_end, end + 4 - line_end);
+    req->headers[end + 4 - line_end] = 0;
+
+    if (!http_get_header(req, "Transfer-Encoding", value, sizeof(value)))
+        return 501;
+    if (!http_get_header(req, "Content-Length", value, sizeof(value)))
+        req->content_length = strtoul(value, 0, 10);
+    if (req->content_length > HTTP_MAX_BODY)
+        return 413;
+    reserve(conn, hdrlen + req->content_length);
+    while (conn->len < hdrlen + req->content_length)
+        if (receive(conn))
+            return -1;
+    req->body = (char *)malloc(req->content_length + 1);
+    memcpy(req->body, conn->buf + hdrlen, req->content_length);
+    req->body[req->content_length] = 0;
+    conn->len -= hdrlen + req->content_length;
+    memmove(conn->buf, conn->buf + hdrlen + req->content_length, conn->len);
+
+    if (!http_get_header(req, "Connection", value, sizeof(value)))
+        req->keep_alive = req->version == 10 ? !strcasecmp(value, "keep-alive") : !!strcasecmp(value, "close");
+    else
+        req->keep_alive = req->version == 11;
+    return 0;
+}
+
+// Copy the value of an HTTP header to value, the name is case insensitive
+int http_get_header(const struct http_request *req, const char *header, char *value, int size)
+{
+    int len = strlen(header);
+    const char *p = req->headers, *q;
+
+    while (p && p[2] != '\r')
+    {
+        p += 2;
+        if (!strncasecmp(p, header, len) && p[len] == ':')
+        {
+            for (p += len + 1; *p == ' ' || *p == '\t'; p++)
+                ;
+            q = strstr(p, "\r\n");
+            while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+                q--;
+            if (!q || q - p >= size)
+                return -1;
+            memcpy(value, p, q - p);
+            value[q - p] = 0;
+            return 0;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return -1;
+}
+
+const char *http_status_text(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 412:
+        return "Precondition Failed";
+    case 413:
+        return "Payload Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 501:
+        return "Not Implemented";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+// Write all the buffers, continuing after partial writes
+int http_writev(int sk, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt)
+    {
+        ssize_t n = writev(sk, iov, iovcnt);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        while (iovcnt && n >= (ssize_t)iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Send headers and body with one writev, the body is omitted for HEAD requests
+int http_send_response(int sk, const struct http_request *req, int status, const char *content_type,
+                       const char *body, size_t len, const char *extra_headers)
+{
+    char headers[1024], length[40] = "";
+    struct iovec iov[2];
+    int keep_alive = req && req->keep_alive && (len != HTTP_NO_LENGTH || req->head);
+
+    if (len != HTTP_NO_LENGTH)
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n", len);
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 %d %s\r\n"
+             "%s%s%s"
+             "%s"
+             "%s"
+             "Connection: %s\r\n\r\n",
+             status, http_status_text(status),
+             content_type ? "Content-Type: " : "", content_type ? content_type : "", content_type ? "\r\n" : "",
+             length, extra_headers ? extra_headers : "", keep_alive ? "keep-alive" : "close");
+    iov[0].iov_base = headers;
+    iov[0].iov_len = strlen(headers);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = body && len != HTTP_NO_LENGTH && !(req && req->head) ? len : 0;
+    return http_writev(sk, iov, iov[1].iov_len ? 2 : 1);
+}
@@ -0,0 +1,47 @@
+#ifndef _HTTP_H_INCLUDED_
+#define _HTTP_H_INCLUDED_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Passed as length for responses without Content-Length, like streams
+#define HTTP_NO_LENGTH ((size_t)-1)
+
+    struct http_conn
+    {
+        int sk;
+        char *buf;
+        int size, len;
+    };
+
+    struct http_request
+    {
+        char method[16], path[1024];
+        int version;
+        // Header lines, each one preceded by \r\n and terminated by an empty line
+        char *headers;
+        char *body;
+        size_t content_length;
+        int keep_alive, head;
+    };
+
+    void http_conn_init(struct http_conn *conn, int sk);
+    void http_conn_free(struct http_conn *conn);
+    int http_read_request(struct http_conn *conn, struct http_request *req);
+    void http_request_free(struct http_request *req);
+    int http_get_header(const struct http_request *req, const char *header, char *value, int size);
+    const char *http_status_text(int status);
+    int http_writev(int sk, struct iovec *iov, int iovcnt);
+    int http_send_response(int sk, const struct http_request *req, int status, const char *content_type,
+                           const char *body, size_t len, const char *extra_headers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "record.h"
+
+#define QUEUE_SIZE (16 * 1024 * 1024)
+// Largest single write
+#define WRITE_SIZE (1024 * 1024)
+// Written data is dropped from the page cache after this much, so that recording does not
+// push everything else out of it
+#define FLUSH_SIZE (8 * 1024 * 1024)
+#define MAX_PATH 400
+// Seconds after a failed open or write before the recording starts again
+#define RETRY_TIME 5
+
+// One recording, the encoder thread fills the queue and the writer thread writes it to files.
+// A full queue is never waited for, the recording skips to the next keyframe instead
+static struct
+{
+    char dir[300];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *queue;
+    size_t head, len;
+    // Bytes queued and written since the start, and where the next file starts, -1 for nowhere.
+    // Files are only opened there, the first one at the start
+    int64_t queued, written, cut;
+    double segment_start;
+    int dropping;
+    // Names of the files kept, the oldest one is deleted for a new one
+    char (*files)[MAX_PATH];
+    int keep, nfiles;
+} rec = {"", PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 0};
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Muxer output, never blocks the encoder
+int record_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    pthread_mutex_lock(&rec.mutex);
+    if (rec.dropping || rec.len + buf_size > QUEUE_SIZE)
+    {
+        if (!rec.dropping)
+            fprintf(stderr, "Recording does not keep up, skipping to the next keyframe\n");
+        rec.dropping = 1;
+    }
+    else
+    {
+        size_t tail = (rec.head + rec.len) % QUEUE_SIZE, first = QUEUE_SIZE - tail;
+
+        if (first > (size_t)buf_size)
+            first = buf_size;
+        memcpy(rec.queue + tail, buf, first);
+        memcpy(rec.queue, buf + first, buf_size - first);
+        rec.len += buf_size;
+        rec.queued += buf_size;
+        pthread_cond_broadcast(&rec.cond);
+    }
+    pthread_mutex_unlock(&rec.mutex);
+    return buf_size;
+}
+
+// Called before every video packet, a new file is started at a keyframe when the current one is
+// long enough or data was dropped
+void record_packet(void *opaque, int key, int64_t pts)
+{
+    double now = now_seconds();
+
+    if (!key)
+        return;
+    pthread_mutex_lock(&rec.mutex);
+    if (rec.dropping && rec.len < QUEUE_SIZE / 2)
+    {
+        rec.dropping = 0;
+        rec.cut = rec.queued;
+        rec.segment_start = now;
+    }
+    else if (!rec.dropping && rec.cut < 0 && now - rec.segment_start >= RECORD_SEGMENT)
+    {
+        rec.cut = rec.queued;
+        rec.segment_start = now;
+    }
+    pthread_mutex_unlock(&rec.mutex);
+}
+
+// A restarted stream goes into a new file, its tables and time stamps start again
+void record_restart(void *opaque)
+{
+    pthread_mutex_lock(&rec.mutex);
+    rec.cut = rec.queued;
+    rec.segment_start = now_seconds();
+    pthread_mutex_unlock(&rec.mutex);
+}
+
+// Close the current file and open a new one named after the local time, with a number when
+// the name is taken. The oldest file is only deleted when the new one is open
+static int next_file(int fd)
+{
+    char name[32], path[MAX_PATH];
+    char *slot = rec.files[rec.nfiles % rec.keep];
+    time_t t = time(0);
+    struct tm tm;
+
+    if (fd >= 0)
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    localtime_r(&t, &tm);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+    fd = -1;
+    for (int i = 0; i < 100 && fd < 0; i++)
+    {
+        if (i)
+            snprintf(path, sizeof(path), "%s/%s-%d.ts", rec.dir, name, i);
+        else
+            snprintf(path, sizeof(path), "%s/%s.ts", rec.dir, name);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 && errno != EEXIST)
+            break;
+    }
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    // The ring is full, the oldest file goes
+    if (rec.nfiles >= rec.keep && unlink(slot) < 0)
+        perror(slot);
+    strcpy(slot, path);
+    rec.nfiles++;
+    printf("Recording to %s\n", path);
+    return fd;
+}
+
+static void *record_thread(void *arg)
+{
+    int fd = -1;
+    size_t unflushed = 0;
+    double retry = 0;
+
+    for (;;)
+    {
+        size_t n;
+        int cut = 0;
+        ssize_t ret;
+
+        pthread_mutex_lock(&rec.mutex);
+        while (!rec.len)
+            pthread_cond_wait(&rec.cond, &rec.mutex);
+        n = rec.len < WRITE_SIZE ? rec.len : WRITE_SIZE;
+        if (n > QUEUE_SIZE - rec.head)
+            n = QUEUE_SIZE - rec.head;
+        if (rec.cut == rec.written)
+        {
+            cut = 1;
+            rec.cut = -1;
+        }
+        else if (rec.cut > rec.written && (int64_t)n > rec.cut - rec.written)
+            n = rec.cut - rec.written;
+        // After a failure, the recording starts again with the next file at a keyframe
+        if (retry && now_seconds() >= retry)
+        {
+            rec.dropping = 1;
+            retry = 0;
+        }
+        pthread_mutex_unlock(&rec.mutex);
+
+        // The queued data stays in place until head moves, the encoder only appends
+        if (cut)
+        {
+            fd = next_file(fd);
+            unflushed = 0;
+            if (fd < 0)
+                retry = now_seconds() + RETRY_TIME;
+        }
+        // Without a file the data is dropped
+        ret = fd < 0 ? (ssize_t)n : write(fd, rec.queue + rec.head, n);
+        if (ret < 0)
+        {
+            perror("write");
+            close(fd);
+            fd = -1;
+            ret = n;
+            retry = now_seconds() + RETRY_TIME;
+        }
+        unflushed += ret;
+        if (fd >= 0 && unflushed >= FLUSH_SIZE)
+        {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            unflushed = 0;
+        }
+
+        pthread_mutex_lock(&rec.mutex);
+        rec.head = (rec.head + ret) % QUEUE_SIZE;
+        rec.len -= ret;
+        rec.written += ret;
+        pthread_mutex_unlock(&rec.mutex);
+    }
+    return 0;
+}
+
+// Record into files in dir, keeping the last keep ones
+int record_start(const char *dir, int keep)
+{
+    struct stat st;
+    pthread_t thread;
+
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "Recording directory %s not found\n", dir);
+        return -1;
+    }
+    snprintf(rec.dir, sizeof(rec.dir), "%s", dir);
+    rec.keep = keep > 0 ? keep : 1;
+    rec.files = calloc(rec.keep, MAX_PATH);
+    rec.queue = (uint8_t *)malloc(QUEUE_SIZE);
+    rec.segment_start = now_seconds();
+    if (pthread_create(&thread, NULL, record_thread, 0) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _RECORD_H_INCLUDED_
+#define _RECORD_H_INCLUDED_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Seconds per recorded file, files start with a keyframe
+#define RECORD_SEGMENT 60
+
+    int record_start(const char *dir, int keep);
+    int record_write(void *opaque, uint8_t *buf, int buf_size);
+    void record_packet(void *opaque, int key, int64_t pts);
+    void record_restart(void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
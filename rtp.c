@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+
+#define TS_PACKET_SIZE 188
+#define RTP_HEADER_SIZE 12
+// Payload type of MPEG-2 TS, RFC 3551
+#define RTP_PT_MP2T 33
+#define QUEUE_SIZE (4 * 1024 * 1024)
+// Datagrams can be sent this much faster than the nominal bitrate
+#define PACING_HEADROOM 1.25
+// More queued data than this means the encoder overshoots, the queue is drained without pacing
+#define MAX_QUEUE_DELAY 0.5
+
+// One multicast output, the encoder thread fills the queue and the sender thread
+// sends it in MTU sized datagrams paced to the bitrate
+static struct
+{
+    int sk, rtp, ttl;
+    struct sockaddr_in addr;
+    double rate;
+    uint32_t ssrc;
+    uint16_t seq;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *queue;
+    size_t head, len;
+    // Bytes written since the stream started, a stream cut off may end with part of a TS packet
+    uint64_t written;
+} out = {-1, 0, 0, {0}, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Muxer output, blocks when the sender does not keep up
+int rtp_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    int done = 0;
+
+    pthread_mutex_lock(&out.mutex);
+    while (done < buf_size)
+    {
+        size_t tail = (out.head + out.len) % QUEUE_SIZE, n = buf_size - done;
+
+        while (out.len == QUEUE_SIZE)
+            pthread_cond_wait(&out.cond, &out.mutex);
+        if (n > QUEUE_SIZE - out.len)
+            n = QUEUE_SIZE - out.len;
+        if (n > QUEUE_SIZE - tail)
+            n = QUEUE_SIZE - tail;
+        memcpy(out.queue + tail, buf + done, n);
+        out.len += n;
+        out.written += n;
+        done += n;
+        pthread_cond_broadcast(&out.cond);
+    }
+    pthread_mutex_unlock(&out.mutex);
+    return buf_size;
+}
+
+// The stream starts over from a new muxer. A TS packet it was cut off in the middle of is dropped,
+// the sender only takes whole packets so its bytes are all still queued
+void rtp_restart(void *opaque)
+{
+    size_t partial;
+
+    pthread_mutex_lock(&out.mutex);
+    partial = out.written % TS_PACKET_SIZE;
+    out.len -= partial < out.len ? partial : out.len;
+    out.written = 0;
+    pthread_mutex_unlock(&out.mutex);
+}
+
+static void *rtp_thread(void *arg)
+{
+    uint8_t packet[RTP_HEADER_SIZE + RTP_TS_PACKETS * TS_PACKET_SIZE];
+    uint8_t *payload = out.rtp ? packet + RTP_HEADER_SIZE : packet;
+    double next = now_seconds();
+
+    for (;;)
+    {
+        size_t n, first;
+        int overshoot;
+        double now;
+
+        // Only whole TS packets are sent, the queue is TS packet aligned because it starts with one
+        // and a restart drops the packet it cut off. Should it get out of step anyway, the sender
+        // skips to the next sync byte instead of misaligning every later datagram
+        pthread_mutex_lock(&out.mutex);
+        while (out.len < TS_PACKET_SIZE)
+            pthread_cond_wait(&out.cond, &out.mutex);
+        if (out.queue[out.head] != 0x47)
+        {
+            while (out.len && out.queue[out.head] != 0x47)
+            {
+                out.head = (out.head + 1) % QUEUE_SIZE;
+                out.len--;
+            }
+            pthread_cond_broadcast(&out.cond);
+            pthread_mutex_unlock(&out.mutex);
+            continue;
+        }
+        n = out.len < RTP_TS_PACKETS * TS_PACKET_SIZE ? out.len : RTP_TS_PACKETS * TS_PACKET_SIZE;
+        n -= n % TS_PACKET_SIZE;
+        first = QUEUE_SIZE - out.head < n ? QUEUE_SIZE - out.head : n;
+        memcpy(payload, out.queue + out.head, first);
+        memcpy(payload + first, out.queue, n - first);
+        out.head = (out.head + n) % QUEUE_SIZE;
+        out.len -= n;
+        overshoot = out.len > out.rate * MAX_QUEUE_DELAY;
+        pthread_cond_broadcast(&out.cond);
+        pthread_mutex_unlock(&out.mutex);
+
+        now = now_seconds();
+        // No credit is kept for idle time, so keyframes are spread too
+        if (next < now || overshoot)
+            next = now;
+        else
+            usleep((next - now) * 1e6);
+        if (out.rtp)
+        {
+            uint32_t ts = (uint32_t)(now * 90000);
+
+            packet[0] = 0x80;
+            packet[1] = RTP_PT_MP2T;
+            packet[2] = out.seq >> 8;
+            packet[3] = out.seq;
+            packet[4] = ts >> 24;
+            packet[5] = ts >> 16;
+            packet[6] = ts >> 8;
+            packet[7] = ts;
+            packet[8] = out.ssrc >> 24;
+            packet[9] = out.ssrc >> 16;
+            packet[10] = out.ssrc >> 8;
+            packet[11] = out.ssrc;
+            out.seq++;
+            n += RTP_HEADER_SIZE;
+        }
+        if (sendto(out.sk, packet, n, 0, (struct sockaddr *)&out.addr, sizeof(out.addr)) < 0)
+            perror("sendto");
+        next += n / out.rate;
+    }
+    return 0;
+}
+
+// Start sending to rtp://<group>:<port> or udp://<group>:<port>, bitrate is the total stream bitrate
+int rtp_start(const char *url, int bitrate)
+{
+    char ip[100], *p;
+    unsigned char loop = 1, ttl = 1;
+    pthread_t thread;
+    struct timespec now;
+    unsigned seed;
+
+    out.rtp = strncmp(url, "udp://", 6) != 0;
+    if ((p = strstr(url, "://")))
+        url = p + 3;
+    snprintf(ip, sizeof(ip), "%s", url);
+    p = strchr(ip, ':');
+    out.addr.sin_family = AF_INET;
+    out.addr.sin_port = htons(p ? atoi(p + 1) : 5004);
+    if (p)
+        *p = 0;
+    if (inet_pton(AF_INET, ip, &out.addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid multicast address %s\n", ip);
+        return -1;
+    }
+    out.sk = socket(AF_INET, SOCK_DGRAM, 0);
+    if (out.sk < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    // Stay in the LAN, but allow receivers on this host
+    out.ttl = ttl;
+    setsockopt(out.sk, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(out.sk, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    out.rate = bitrate * PACING_HEADROOM / 8;
+    // A seed of its own, the global one belongs to the UPnP side
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed = now.tv_sec ^ now.tv_nsec ^ getpid();
+    out.ssrc = (uint32_t)rand_r(&seed) << 16 ^ rand_r(&seed);
+    out.seq = rand_r(&seed);
+    out.queue = (uint8_t *)malloc(QUEUE_SIZE);
+    if (pthread_create(&thread, NULL, rtp_thread, 0) != 0)
+    {
+        perror("pthread_create");
+        close(out.sk);
+        out.sk = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Session description of the RTP output for players, origin is the address of this host
+int rtp_sdp(char *buf, size_t size, const char *origin)
+{
+    char ip[INET_ADDRSTRLEN], ttl[10] = "";
+
+    if (out.sk < 0 || !out.rtp)
+        return -1;
+    inet_ntop(AF_INET, &out.addr.sin_addr, ip, sizeof(ip));
+    if (IN_MULTICAST(ntohl(out.addr.sin_addr.s_addr)))
+        sprintf(ttl, "/%d", out.ttl);
+    return snprintf(buf, size,
+                    "v=0\r\n"
+                    "o=- %u 1 IN IP4 %s\r\n"
+                    "s=Screencast\r\n"
+                    "c=IN IP4 %s%s\r\n"
+                    "t=0 0\r\n"
+                    "m=video %d RTP/AVP %d\r\n"
+                    "a=rtpmap:%d MP2T/90000\r\n",
+                    out.ssrc, origin, ip, ttl, ntohs(out.addr.sin_port), RTP_PT_MP2T, RTP_PT_MP2T);
+}
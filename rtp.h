@@ -0,0 +1,24 @@
+#ifndef _RTP_H_INCLUDED_
+#define _RTP_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// MPEG-TS packets per datagram, 7 * 188 + 12 bytes of RTP header fit in an Ethernet MTU
+#define RTP_TS_PACKETS 7
+
+    int rtp_start(const char *url, int bitrate);
+    int rtp_write(void *opaque, uint8_t *buf, int buf_size);
+    void rtp_restart(void *opaque);
+    int rtp_sdp(char *buf, size_t size, const char *origin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,7 +2,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <ctype.h>
 #include <sys/time.h>
 #include <sys/times.h>
 #include <sys/types.h>
@@ -13,6 +12,7 @@
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <libpostproc/postprocess.h>
@@ -22,130 +22,155 @@
 
 #include "ssdp.h"
 #include "alsa.h"
+#include "catalog.h"
+#include "hls.h"
+#include "rtp.h"
+#include "capture.h"
+#include "tsmux.h"
+#include "record.h"
+#include "control.h"
+#include "xconn.h"
 
 #define AUFRAMELEN 1024
+// Audio frames read with one video frame at most
+#define MAX_JOB_AUFRAMES 16
+#define MAX_LADDER 8
+#define MAX_CROPS 8
+#define SCALER_CACHE_SIZE 4
+// While the input size changes, a fast filter is used until it is stable for this many seconds
+#define RESIZE_SETTLE 0.3
+// While the input shrinks, the fast scaler takes this fraction less of each side, so that it
+// serves the next smaller sizes too
+#define RESIZE_SHRINK_MARGIN 8
+// Unchanged content is sent again at this interval, to keep players going
+#define STATIC_INTERVAL 0.5
+// Quantizer offsets of the changed and the unchanged parts of the frame, libx264 scales them by 25
+#define ROI_CHANGED_QOFFSET (AVRational){-1, 5}
+#define ROI_STATIC_QOFFSET (AVRational){1, 5}
+// The encoder steps to a faster preset when encoding takes more than PRESET_LOAD_HIGH of the
+// frame interval, and back after PRESET_HOLD seconds below PRESET_LOAD_LOW
+#define PRESET_LOAD_HIGH 0.7
+#define PRESET_LOAD_LOW 0.25
+#define PRESET_HOLD 10
+// Renditions and their capture stay open this many seconds after the last client left, so that
+// clients probing the stream and coming back start right away
+#define SESSION_LINGER 10
+// Bytes queued for a client before it is dropped, some seconds of the stream
+#define CLIENT_QUEUE (4 * 1024 * 1024)
+// Rate control buffer in seconds and how much of it is filled before decoding starts
+#define VBV_DURATION 0.5
+#define VBV_INITIAL 0.25
+// Largest slice in bytes and PCR interval in milliseconds in low latency mode
+#define LOW_LATENCY_SLICE 1316
+#define LOW_LATENCY_PCR_PERIOD 20
+// Time stamps of the built-in muxer are ahead of the PCR by this much, in 90 kHz units, as with libavformat
+#define TSMUX_DELAY 63000
+#define PRESET_UNCHANGED -1
+#define PRESET_AUTO -2
+#define SCALER_FLAGS (SWS_BICUBIC | PP_CPU_CAPS_MMX | PP_CPU_CAPS_MMX2)
+#define RESIZE_SCALER_FLAGS SWS_FAST_BILINEAR
 
 struct opt
 {
     int fps, bitrate, width, height, local_port;
-    char recdevice[100];
+    char recdevice[100], multicast[100], multicast_source[300], record[300];
+    // Minutes of recording kept
+    int record_minutes;
+    // Additional renditions offered in Browse
+    struct
+    {
+        int width, height, bitrate;
+    } ladder[MAX_LADDER];
+    int nladder;
+    // Regions listed in Browse as items of their own
+    struct
+    {
+        int x, y, width, height;
+        char source[300];
+    } crops[MAX_CROPS];
+    int ncrops;
+    int letterbox, low_latency, tsmux;
+    // Audio of new sessions is muted, set through the control API
+    int mute;
 } opt;
 
-void strcpysafechars(char *dst, const char *src)
+double seconds();
+
+// x264 presets used by the governor, the first one is the x264 default
+static const char *presets[] = {"medium", "fast", "faster", "veryfast", "superfast", "ultrafast"};
+
+// The cores are split evenly between the video encoders with clients, instead of every x264
+// instance starting as many threads as there are cores. Only x264 threads are counted, the
+// capture threads and the scaling and audio encoding on the rendition threads are not
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int budget_encoders;
+
+static void budget_update(int change)
 {
-    while (*src)
-    {
-        if (isalnum((unsigned char)*src))
-            *dst++ = *src;
-        else if (*src == ' ')
-            *dst++ = '_';
-        else
-            *dst++ = '.';
-        src++;
-    }
-    *dst = 0;
+    pthread_mutex_lock(&budget_mutex);
+    budget_encoders += change;
+    pthread_mutex_unlock(&budget_mutex);
 }
 
-char **get_stream_items()
+// Threads for one video encoder
+static int budget_threads()
 {
-    Display *display = XOpenDisplay(NULL);
-    Atom actualType;
-    int format;
-    unsigned long numItems;
-    unsigned long bytesAfter;
-    char **items = 0, item[1000];
-    unsigned char *data = 0;
-    Window *list;
-    char *windowName;
+    int cores = sysconf(_SC_NPROCESSORS_ONLN), threads;
 
-    if (!display)
-    {
-        fprintf(stderr, "Cannot open display\n");
-        return 0;
-    }
-    Window rootWindow = RootWindow(display, DefaultScreen(display));
-    Atom atom = XInternAtom(display, "_NET_CLIENT_LIST", 1);
+    pthread_mutex_lock(&budget_mutex);
+    threads = cores / (budget_encoders > 0 ? budget_encoders : 1);
+    pthread_mutex_unlock(&budget_mutex);
+    return threads > 0 ? threads : 1;
+}
 
-    int status = XGetWindowProperty(display, rootWindow, atom, 0L, (~0L), 0, AnyPropertyType, &actualType, &format, &numItems, &bytesAfter, &data);
-    list = (Window *)data;
+char **get_stream_items(unsigned *update_id)
+{
+    struct catalog_item *list;
+    struct catalog_monitor *monitors;
+    int numItems = catalog_get_items(&list, update_id), nmonitors;
+    char **items = (char **)malloc(sizeof(char *) * (numItems + 1)), item[600];
+    int n = 0;
 
-    if (status >= Success && numItems)
+    for (int i = 0; i < numItems; i++)
     {
-        items = (char **)malloc(sizeof(char *) * (numItems + 2));
-        int n = 0;
-        items[n++] = strdup("Desktop\tDesktop");
-        for (int i = 0; i < numItems; ++i)
-        {
-            status = XFetchName(display, list[i], &windowName);
-            printf("%d/%ld %s\n", i, numItems, windowName);
-            if (status >= Success && windowName)
-            {
-                if (*windowName && strcmp(windowName, "Desktop"))
-                {
-                    strcpy(item, windowName);
-                    strcat(item, "\t");
-                    strcpysafechars(item + strlen(item), windowName);
-                    items[n++] = strdup(item);
-                }
-                XFree(windowName);
-            }
-        }
-        items[n] = 0;
+        // Skip windows without title, but always list the Desktop first
+        if (i && (!*list[i].title || !strcmp(list[i].title, "Desktop")))
+            continue;
+        // The stream path is the window ID followed by the title, only the ID is used for lookup
+        snprintf(item, sizeof(item), "%s\t%lx/%s", list[i].title, list[i].window, list[i].safename);
+        items[n++] = strdup(item);
     }
-    XFree(data);
-    XCloseDisplay(display);
-    return items;
-}
-
-// Find the DOSBox Window so we can do cool stuff with it!
-Window findWindowByName(Display *display, const char *name)
-{
-    Window rootWindow = RootWindow(display, DefaultScreen(display));
-    if (!strcmp(name, "Desktop"))
+    // With more than one monitor, each one is listed as a region of the Desktop
+    nmonitors = catalog_get_monitors(&monitors);
+    items = (char **)realloc(items, sizeof(char *) * (n + nmonitors + 1));
+    for (int i = 0; nmonitors > 1 && i < nmonitors; i++)
     {
-        printf("Returned rootWindow\n");
-        return rootWindow;
+        snprintf(item, sizeof(item), "Monitor %s %dx%d\t%lx/Desktop?x=%d&y=%d&w=%d&h=%d", monitors[i].name,
+                 monitors[i].width, monitors[i].height, list[0].window, monitors[i].x, monitors[i].y,
+                 monitors[i].width, monitors[i].height);
+        items[n++] = strdup(item);
     }
-    Atom atom = XInternAtom(display, "_NET_CLIENT_LIST", 1);
-    Atom actualType;
-    int format;
-    unsigned long numItems;
-    unsigned long bytesAfter;
-
-    unsigned char *data = 0;
-    Window *list;
-    char *windowName;
-
-    int status = XGetWindowProperty(display, rootWindow, atom, 0L, (~0L), 0, AnyPropertyType, &actualType, &format, &numItems, &bytesAfter, &data);
-    list = (Window *)data;
-
-    if (status >= Success && numItems)
+    free(monitors);
+    for (int i = 0; i < opt.ncrops; i++)
     {
-        for (int i = 0; i < numItems; ++i)
-        {
-            char safename[300];
-            status = XFetchName(display, list[i], &windowName);
-            if (windowName)
-                strcpysafechars(safename, windowName);
-            else
-                *safename = 0;
-            if (status >= Success && windowName)
-            {
-                if (!strcmp(safename, name))
-                {
-                    printf("Returned window %s\n", windowName);
-                    Window w = (Window)list[i];
-                    XFree(windowName);
-                    XFree(data);
-                    return w;
-                }
-                XFree(windowName);
-            }
-        }
+        Window w = catalog_find(opt.crops[i].source);
+
+        if (!w)
+            continue;
+        items = (char **)realloc(items, sizeof(char *) * (n + 2));
+        snprintf(item, sizeof(item), "%s %dx%d+%d+%d\t%lx/%s?x=%d&y=%d&w=%d&h=%d", opt.crops[i].source,
+                 opt.crops[i].width, opt.crops[i].height, opt.crops[i].x, opt.crops[i].y, w, opt.crops[i].source,
+                 opt.crops[i].x, opt.crops[i].y, opt.crops[i].width, opt.crops[i].height);
+        items[n++] = strdup(item);
     }
-    fprintf(stderr, "No window found\n");
-    XFree(data);
-    return 0;
+    items[n] = 0;
+    free(list);
+    return items;
+}
+
+unsigned get_system_update_id()
+{
+    return catalog_get_update_id();
 }
 
 int write_packet(void *opaque, uint8_t *buf, int buf_size)
@@ -153,78 +178,150 @@ int write_packet(void *opaque, uint8_t *buf, int buf_size)
     return write((int)(size_t)opaque, buf, buf_size);
 }
 
+// Destination of the muxed stream, a socket or the HLS segmenter
+struct sink
+{
+    int (*write)(void *opaque, uint8_t *buf, int buf_size);
+    // Called before every video packet with everything muxed so far written out
+    void (*packet)(void *opaque, int key, int64_t pts);
+    // Returns nonzero when nobody wants the stream anymore
+    int (*stopped)(void *opaque);
+    void *opaque;
+    // Keyframe interval in frames, 0 for the encoder default
+    int gop;
+    // Called before the stream starts again from a new encoder, with new tables and time stamps
+    void (*restart)(void *opaque);
+};
+
+// Scaler contexts are cached by input size, output rectangle in the frame and filter
+struct scaler
+{
+    int iwidth, iheight, x, y, owidth, oheight, flags;
+    struct SwsContext *sws;
+    unsigned last_used;
+};
+
 struct ctx
 {
+    struct sink *sink;
     AVFormatContext *output_ctx;
     AVCodecContext *videoenc_ctx, *audioenc_ctx;
     AVStream *video_stream, *audio_stream;
     AVFrame *frame, *auframe;
     AVPacket *packet, *aupacket;
     uint8_t *avio_ctx_buffer;
-    struct SwsContext *sws;
-    int iwidth, iheight;
+    // Built-in muxer used instead of libavformat
+    struct tsmux *tsmux;
+    struct scaler scalers[SCALER_CACHE_SIZE], *scaler;
+    unsigned scaler_clock;
+    // Last input size and when it changed
+    int iwidth, iheight, fps;
+    double resize_time;
+    // Index in presets, average encoding time of a frame and when the preset changed. A preset
+    // set through the control API is kept
+    int preset, preset_fixed;
+    double encode_time, preset_time;
+    // Encoder threads within the budget, taken when the encoder is opened or reopened, and
+    // whether the encoder counts in the budget
+    int threads, budgeted;
 };
 
-struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight, int fps, int bitrate, int abitrate)
+static AVCodecContext *open_video_encoder(int width, int height, int fps, int bitrate, int gop, const char *preset,
+                                          int threads)
 {
-    struct ctx *ctx;
-
-    ctx = (struct ctx *)calloc(1, sizeof(*ctx));
-    ctx->iwidth = width;
-    ctx->iheight = height;
-    // Create the output MPEG-2 TS file
-    if (avformat_alloc_output_context2(&ctx->output_ctx, NULL, "mpegts", 0) < 0)
-    {
-        fprintf(stderr, "Failed to allocate output context\n");
-        free(ctx);
-        return 0;
-    }
+    AVCodecContext *enc = avcodec_alloc_context3(avcodec_find_encoder(AV_CODEC_ID_H264));
+    AVDictionary *options = NULL;
 
-    // Create the video encoder context
-    ctx->videoenc_ctx = avcodec_alloc_context3(avcodec_find_encoder(AV_CODEC_ID_H264));
-    if (!ctx->videoenc_ctx)
+    if (!enc)
     {
         fprintf(stderr, "Failed to allocate encoder context\n");
-        avformat_free_context(ctx->output_ctx);
-        free(ctx);
         return 0;
     }
-
     // Set the video encoder parameters
-    ctx->videoenc_ctx->width = owidth;
-    ctx->videoenc_ctx->height = oheight;
-    ctx->videoenc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    ctx->videoenc_ctx->time_base = (AVRational){1, fps};
-    ctx->videoenc_ctx->framerate = (AVRational){fps, 1};
-    ctx->videoenc_ctx->bit_rate = bitrate;
-    // videoenc_ctx->max_b_frames = 0; // To reduce latency
-
-    AVDictionary *options = NULL;
+    enc->width = width;
+    enc->height = height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    // Frames are stamped with the capture time and skipped while the content is static, so the
+    // rate control gets their real durations in 90 kHz units, fps is only the nominal rate
+    enc->time_base = (AVRational){1, 90000};
+    enc->framerate = (AVRational){fps, 1};
+    enc->bit_rate = bitrate;
+    // A small buffer lets players start decoding soon after the keyframe
+    enc->rc_max_rate = bitrate;
+    enc->rc_buffer_size = (int)(bitrate * VBV_DURATION);
+    enc->rc_initial_buffer_occupancy = (int)(bitrate * VBV_DURATION * VBV_INITIAL);
+    enc->thread_count = threads;
+    if (gop)
+        enc->gop_size = gop;
+    // enc->max_b_frames = 0; // To reduce latency
 
+    av_dict_set(&options, "preset", preset, 0);
     // Set the tune
     if (av_dict_set(&options, "tune", "zerolatency", 0) < 0)
     {
         fprintf(stderr, "Error setting libx264 tune\n");
         av_dict_free(&options);
     }
+    // Keyframes forced for joining clients have to be IDR frames
+    av_dict_set(&options, "forced-idr", "1", 0);
+    // Small slices on parallel threads, so that every slice can be sent and decoded on its own
+    if (opt.low_latency)
+    {
+        char params[100];
+
+        snprintf(params, sizeof(params), "sliced-threads=1:slice-max-size=%d", LOW_LATENCY_SLICE);
+        av_dict_set(&options, "x264-params", params, 0);
+    }
 
     // Open the video encoder
-    if (avcodec_open2(ctx->videoenc_ctx, avcodec_find_encoder(AV_CODEC_ID_H264), &options) < 0)
+    if (avcodec_open2(enc, avcodec_find_encoder(AV_CODEC_ID_H264), &options) < 0)
     {
         fprintf(stderr, "Failed to open video encoder\n");
         av_dict_free(&options);
-        avcodec_free_context(&ctx->videoenc_ctx);
+        avcodec_free_context(&enc);
+        return 0;
+    }
+    av_dict_free(&options);
+    return enc;
+}
+
+struct ctx *open_encoder(struct sink *sink, int width, int height, int owidth, int oheight, int fps, int bitrate, int abitrate)
+{
+    struct ctx *ctx;
+
+    ctx = (struct ctx *)calloc(1, sizeof(*ctx));
+    ctx->sink = sink;
+    ctx->iwidth = width;
+    ctx->iheight = height;
+    ctx->fps = fps;
+    // Create the output MPEG-2 TS file
+    if (avformat_alloc_output_context2(&ctx->output_ctx, NULL, "mpegts", 0) < 0)
+    {
+        fprintf(stderr, "Failed to allocate output context\n");
+        free(ctx);
+        return 0;
+    }
+
+    // Create the video encoder
+    budget_update(1);
+    ctx->budgeted = 1;
+    ctx->threads = budget_threads();
+    ctx->videoenc_ctx = open_video_encoder(owidth, oheight, fps, bitrate, sink->gop, presets[0], ctx->threads);
+    ctx->preset_time = seconds();
+    if (!ctx->videoenc_ctx)
+    {
+        budget_update(-1);
         avformat_free_context(ctx->output_ctx);
         free(ctx);
         return 0;
     }
-    av_dict_free(&options);
     // Add the video stream to the output context
     ctx->video_stream = avformat_new_stream(ctx->output_ctx, NULL);
     if (!ctx->video_stream)
     {
         fprintf(stderr, "Failed to create output stream\n");
         avcodec_free_context(&ctx->videoenc_ctx);
+        budget_update(-1);
         avformat_free_context(ctx->output_ctx);
         free(ctx);
         return 0;
@@ -240,6 +337,7 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
         {
             fprintf(stderr, "Failed to allocate encoder context\n");
             avcodec_free_context(&ctx->videoenc_ctx);
+            budget_update(-1);
             avformat_free_context(ctx->output_ctx);
             free(ctx);
             return 0;
@@ -251,6 +349,7 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
         ctx->audioenc_ctx->time_base = (AVRational){1, 48000};
         ctx->audioenc_ctx->sample_rate = 48000;
         ctx->audioenc_ctx->bit_rate = abitrate;
+        ctx->audioenc_ctx->thread_count = 1;
 
         // Open the audio encoder
         if (avcodec_open2(ctx->audioenc_ctx, avcodec_find_encoder(AV_CODEC_ID_AAC), 0) < 0)
@@ -258,6 +357,7 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
             fprintf(stderr, "Failed to open audio encoder\n");
             avcodec_free_context(&ctx->audioenc_ctx);
             avcodec_free_context(&ctx->videoenc_ctx);
+            budget_update(-1);
             avformat_free_context(ctx->output_ctx);
             free(ctx);
             return 0;
@@ -269,6 +369,7 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
             fprintf(stderr, "Failed to create audio output stream\n");
             avcodec_free_context(&ctx->audioenc_ctx);
             avcodec_free_context(&ctx->videoenc_ctx);
+            budget_update(-1);
             avformat_free_context(ctx->output_ctx);
             free(ctx);
             return 0;
@@ -286,20 +387,31 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
 
     ctx->avio_ctx_buffer = (uint8_t *)av_malloc(4096);
 
-    ctx->output_ctx->pb = avio_alloc_context(ctx->avio_ctx_buffer, 4096, 1, (void *)(size_t)csk, 0, write_packet, 0);
+    ctx->output_ctx->pb = avio_alloc_context(ctx->avio_ctx_buffer, 4096, 1, sink->opaque, 0, sink->write, 0);
     /*if (avio_open(&ctx->output_ctx->pb, "test.ts", AVIO_FLAG_WRITE) < 0) // For debugging
     {
         fprintf(stderr, "Failed to open output file: %s\n", "test.ts");
         avcodec_free_context(&ctx->videoenc_ctx);
+        budget_update(-1);
         avformat_free_context(ctx->output_ctx);
         free(ctx);
         return 1;
     }*/
-    if (avformat_init_output(ctx->output_ctx, 0) < 0)
+    // Every packet goes out as soon as it is muxed, with frequent PCRs and without mux delay
+    if (opt.low_latency)
+    {
+        ctx->output_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        ctx->output_ctx->max_delay = 0;
+        av_opt_set_int(ctx->output_ctx->priv_data, "pcr_period", LOW_LATENCY_PCR_PERIOD, 0);
+    }
+    if (opt.tsmux ? !(ctx->tsmux = tsmux_open(sink->write, sink->opaque, abitrate != 0,
+                                              opt.low_latency ? 0 : TSMUX_DELAY))
+                  : avformat_init_output(ctx->output_ctx, 0) < 0)
     {
         fprintf(stderr, "Failed to initialize output\n");
         avio_context_free(&ctx->output_ctx->pb);
         avcodec_free_context(&ctx->videoenc_ctx);
+        budget_update(-1);
         if (ctx->audioenc_ctx)
             avcodec_free_context(&ctx->audioenc_ctx);
         avformat_free_context(ctx->output_ctx);
@@ -314,6 +426,7 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
         fprintf(stderr, "Failed to allocate video frame\n");
         avio_context_free(&ctx->output_ctx->pb);
         avcodec_free_context(&ctx->videoenc_ctx);
+        budget_update(-1);
         if (ctx->audioenc_ctx)
             avcodec_free_context(&ctx->audioenc_ctx);
         avformat_free_context(ctx->output_ctx);
@@ -327,47 +440,302 @@ struct ctx *open_encoder(int csk, int width, int height, int owidth, int oheight
     av_frame_get_buffer(ctx->frame, 32);
     printf("open_encoder ok, w=%d h=%d\n", ctx->frame->width, ctx->frame->height);
     ctx->packet = av_packet_alloc();
-    ctx->sws = sws_getContext(width, height, AV_PIX_FMT_BGRA, owidth, oheight, AV_PIX_FMT_YUV420P, SWS_BICUBIC | PP_CPU_CAPS_MMX | PP_CPU_CAPS_MMX2, 0, 0, 0);
 
     return ctx;
 }
 
-int sendframe(struct ctx *ctx, const void *data)
+// Find the scaler in the cache or replace the least recently used one
+static struct scaler *get_scaler(struct ctx *ctx, int iwidth, int iheight, int flags)
 {
-    int srcStride[1] = {ctx->iwidth * 4};
-    sws_scale(ctx->sws, (const uint8_t *const *)&data, srcStride, 0, ctx->iheight, ctx->frame->data, ctx->frame->linesize);
+    struct scaler *scaler = &ctx->scalers[0];
+    int owidth = ctx->frame->width, oheight = ctx->frame->height;
 
+    for (int i = 0; i < SCALER_CACHE_SIZE; i++)
+    {
+        if (ctx->scalers[i].sws && ctx->scalers[i].iwidth == iwidth && ctx->scalers[i].iheight == iheight &&
+            ctx->scalers[i].flags == flags)
+        {
+            ctx->scalers[i].last_used = ++ctx->scaler_clock;
+            return &ctx->scalers[i];
+        }
+        if (ctx->scalers[i].last_used < scaler->last_used)
+            scaler = &ctx->scalers[i];
+    }
+    // Letterboxing keeps the aspect ratio of the input
+    if (opt.letterbox)
+    {
+        if ((int64_t)iwidth * oheight > (int64_t)iheight * owidth)
+            oheight = (int)((int64_t)iheight * owidth / iwidth) & ~1;
+        else
+            owidth = (int)((int64_t)iwidth * oheight / iheight) & ~1;
+        owidth = owidth < 2 ? 2 : owidth;
+        oheight = oheight < 2 ? 2 : oheight;
+    }
+    sws_freeContext(scaler->sws);
+    *scaler = (struct scaler){iwidth, iheight, (ctx->frame->width - owidth) / 2 & ~1,
+                              (ctx->frame->height - oheight) / 2 & ~1, owidth, oheight, flags};
+    scaler->sws = sws_getContext(iwidth, iheight, AV_PIX_FMT_BGRA, owidth, oheight, AV_PIX_FMT_YUV420P, flags, 0, 0, 0);
+    scaler->last_used = ++ctx->scaler_clock;
+    return scaler;
+}
+
+// Pick the scaler for the input size. While the size keeps changing, like when a window edge
+// is dragged, the previous scaler is kept on the top left part of a larger input, otherwise a
+// scaler with a fast filter is set up for a part of it, and the good one when the size is stable
+static struct scaler *select_scaler(struct ctx *ctx, int width, int height)
+{
+    struct scaler *scaler = ctx->scaler;
+    double now = seconds();
+    int settled;
+
+    if (width != ctx->iwidth || height != ctx->iheight)
+    {
+        ctx->iwidth = width;
+        ctx->iheight = height;
+        ctx->resize_time = now;
+    }
+    settled = !scaler || now - ctx->resize_time >= RESIZE_SETTLE;
+    if (scaler && scaler->iwidth == width && scaler->iheight == height && (scaler->flags == SCALER_FLAGS || !settled))
+        return scaler;
+    if (!settled && width >= scaler->iwidth && height >= scaler->iheight)
+        return scaler;
+    if (settled)
+    {
+        if (scaler)
+            printf("Window changed dimensions to w=%d h=%d\n", width, height);
+        return get_scaler(ctx, width, height, SCALER_FLAGS);
+    }
+    // Both sides, a drag often shrinks one after the other
+    width -= width / RESIZE_SHRINK_MARGIN;
+    height -= height / RESIZE_SHRINK_MARGIN;
+    return get_scaler(ctx, width, height, RESIZE_SCALER_FLAGS);
+}
+
+// x264 cannot change its preset, threads or size on the fly, so the video encoder is reopened.
+// The new one starts with an IDR frame, and the muxer continues as before
+static int reopen_video_encoder(struct ctx *ctx, int width, int height, int fps, int bitrate, int preset, int threads)
+{
+    AVCodecContext *enc = open_video_encoder(width, height, fps, bitrate, ctx->videoenc_ctx->gop_size, presets[preset],
+                                             threads);
+
+    ctx->preset_time = seconds();
+    if (!enc)
+        return -1;
+    if (width != ctx->frame->width || height != ctx->frame->height)
+    {
+        AVFrame *frame = av_frame_alloc();
+
+        if (!frame)
+        {
+            avcodec_free_context(&enc);
+            return -1;
+        }
+        frame->width = width;
+        frame->height = height;
+        frame->format = enc->pix_fmt;
+        av_frame_get_buffer(frame, 32);
+        av_frame_free(&ctx->frame);
+        ctx->frame = frame;
+        // The cached scalers are for the old output size
+        for (int i = 0; i < SCALER_CACHE_SIZE; i++)
+            sws_freeContext(ctx->scalers[i].sws);
+        memset(ctx->scalers, 0, sizeof(ctx->scalers));
+        ctx->scaler = 0;
+    }
+    avcodec_free_context(&ctx->videoenc_ctx);
+    ctx->videoenc_ctx = enc;
+    ctx->fps = fps;
+    ctx->preset = preset;
+    ctx->threads = threads;
+    return 0;
+}
+
+// An encoder without clients gives its share of the budget to the others. They take it when
+// they are reopened anyway, restarting a live encoder would cost a keyframe
+static void budget_set_active(struct ctx *ctx, int active)
+{
+    if (active == ctx->budgeted)
+        return;
+    budget_update(active ? 1 : -1);
+    ctx->budgeted = active;
+}
+
+// Keep the encoding time within the frame interval, a new preset comes with the current share
+// of the thread budget
+static void govern_encoder(struct ctx *ctx, double encode_time)
+{
+    AVCodecContext *enc = ctx->videoenc_ctx;
+    double now = seconds(), load;
+    int preset = ctx->preset, threads;
+
+    ctx->encode_time = ctx->encode_time * 0.9 + encode_time * 0.1;
+    load = ctx->encode_time * ctx->fps;
+    // Wait for the average to follow a change
+    if (now - ctx->preset_time < 1)
+        return;
+    if (ctx->preset_fixed)
+        ;
+    else if (load > PRESET_LOAD_HIGH && preset < (int)(sizeof(presets) / sizeof(presets[0])) - 1)
+        preset++;
+    else if (load < PRESET_LOAD_LOW && preset > 0 && now - ctx->preset_time >= PRESET_HOLD)
+        preset--;
+    if (preset == ctx->preset)
+        return;
+    threads = budget_threads();
+    if (!reopen_video_encoder(ctx, enc->width, enc->height, ctx->fps, enc->bit_rate, preset, threads))
+        printf("Switching to preset %s with %d threads, encoding load %.0f%%\n", presets[preset], threads, load * 100);
+}
+
+// Tell the encoder to spend the bits on the tiles of the input that changed. The runs of changed
+// tiles come first, because the first region covering a macroblock wins, then the whole frame
+static void set_regions(struct ctx *ctx, const struct scaler *scaler, const unsigned char *tiles, int columns, int rows)
+{
+    AVFrameSideData *sd;
+    AVRegionOfInterest *roi;
+    int n = 0, changed = 0;
+
+    av_frame_remove_side_data(ctx->frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    // Keyframes and frames that changed everywhere are encoded evenly
+    if (!tiles || ctx->frame->pict_type == AV_PICTURE_TYPE_I)
+        return;
+    // While resizing, only the top left part of the input is scaled
+    if (rows * CAPTURE_TILE > scaler->iheight)
+        rows = (scaler->iheight + CAPTURE_TILE - 1) / CAPTURE_TILE;
+    for (int ty = 0; ty < rows; ty++)
+        for (int tx = 0; tx < columns && tx * CAPTURE_TILE < scaler->iwidth; tx++)
+            if (tiles[ty * columns + tx])
+            {
+                changed++;
+                if (!tx || !tiles[ty * columns + tx - 1])
+                    n++;
+            }
+    if (!changed || changed == rows * ((scaler->iwidth + CAPTURE_TILE - 1) / CAPTURE_TILE))
+        return;
+    sd = av_frame_new_side_data(ctx->frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, (n + 1) * sizeof(*roi));
+    if (!sd)
+        return;
+    roi = (AVRegionOfInterest *)sd->data;
+    for (int ty = 0; ty < rows; ty++)
+        for (int tx = 0; tx < columns && tx * CAPTURE_TILE < scaler->iwidth; tx++)
+        {
+            int end = tx;
+
+            if (!tiles[ty * columns + tx])
+                continue;
+            while (end < columns && end * CAPTURE_TILE < scaler->iwidth && tiles[ty * columns + end])
+                end++;
+            // Map the run of tiles to the output rectangle
+            roi->self_size = sizeof(*roi);
+            roi->top = scaler->y + ty * CAPTURE_TILE * scaler->oheight / scaler->iheight;
+            roi->bottom = scaler->y + FFMIN((ty + 1) * CAPTURE_TILE, scaler->iheight) * scaler->oheight / scaler->iheight;
+            roi->left = scaler->x + tx * CAPTURE_TILE * scaler->owidth / scaler->iwidth;
+            roi->right = scaler->x + FFMIN(end * CAPTURE_TILE, scaler->iwidth) * scaler->owidth / scaler->iwidth;
+            roi->qoffset = ROI_CHANGED_QOFFSET;
+            roi++;
+            tx = end;
+        }
+    *roi = (AVRegionOfInterest){sizeof(*roi), 0, ctx->frame->height, 0, ctx->frame->width, ROI_STATIC_QOFFSET};
+}
+
+// In low latency mode packets are muxed as they come, instead of waiting to interleave them by time.
+// The built-in muxer always writes them right away
+static int write_frame(struct ctx *ctx, AVPacket *packet)
+{
+    if (ctx->tsmux)
+    {
+        if (!packet)
+            return 0;
+        if (packet->stream_index == ctx->video_stream->index)
+            return tsmux_write_video(ctx->tsmux, packet->data, packet->size, packet->pts, packet->dts,
+                                     packet->flags & AV_PKT_FLAG_KEY);
+        return tsmux_write_audio(ctx->tsmux, packet->data, packet->size, packet->pts);
+    }
+    if (opt.low_latency)
+        return av_write_frame(ctx->output_ctx, packet);
+    return av_interleaved_write_frame(ctx->output_ctx, packet);
+}
+
+// Encode the image at pts, without data the previous frame is encoded again. tiles marks the
+// tiles of the image that changed since the previous frame, null when unknown
+int sendframe(struct ctx *ctx, const void *data, int width, int height, int stride, int64_t pts,
+              const unsigned char *tiles, int columns, int rows)
+{
+    struct scaler *scaler;
+    int srcStride[1] = {stride};
+    uint8_t *dst[3];
+
+    ctx->frame->pts = pts;
+    if (!data)
+    {
+        av_frame_remove_side_data(ctx->frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+        goto encode;
+    }
+    scaler = select_scaler(ctx, width, height);
+
+    // The bars around a smaller output rectangle are black
+    if (!ctx->scaler || scaler->x != ctx->scaler->x || scaler->y != ctx->scaler->y ||
+        scaler->owidth != ctx->scaler->owidth || scaler->oheight != ctx->scaler->oheight)
+    {
+        memset(ctx->frame->data[0], 16, ctx->frame->linesize[0] * ctx->frame->height);
+        memset(ctx->frame->data[1], 128, ctx->frame->linesize[1] * ctx->frame->height / 2);
+        memset(ctx->frame->data[2], 128, ctx->frame->linesize[2] * ctx->frame->height / 2);
+    }
+    ctx->scaler = scaler;
+    dst[0] = ctx->frame->data[0] + scaler->y * ctx->frame->linesize[0] + scaler->x;
+    dst[1] = ctx->frame->data[1] + scaler->y / 2 * ctx->frame->linesize[1] + scaler->x / 2;
+    dst[2] = ctx->frame->data[2] + scaler->y / 2 * ctx->frame->linesize[2] + scaler->x / 2;
+    sws_scale(scaler->sws, (const uint8_t *const *)&data, srcStride, 0, scaler->iheight, dst, ctx->frame->linesize);
+    set_regions(ctx, scaler, tiles, columns, rows);
+
+encode:;
+    double start = seconds();
     int ret = avcodec_send_frame(ctx->videoenc_ctx, ctx->frame);
     if (ret < 0)
         return 0;
 
     ret = avcodec_receive_packet(ctx->videoenc_ctx, ctx->packet);
+    // Repeated frames cost next to nothing and say nothing about the load
+    if (data)
+        govern_encoder(ctx, seconds() - start);
     if (ret < 0)
     {
         // printf("pts=%ld, not processed, yet\n", ctx->frame->pts);
-        ctx->frame->pts += 90000 / opt.fps;
         return 0;
     }
     ctx->packet->stream_index = ctx->video_stream->index;
+    av_packet_rescale_ts(ctx->packet, ctx->videoenc_ctx->time_base, ctx->video_stream->time_base);
+    if (ctx->sink->packet)
+    {
+        int key = ctx->packet->flags & AV_PKT_FLAG_KEY;
+
+        // Flush the muxer, so that parts and segments are cut at packet boundaries
+        write_frame(ctx, NULL);
+        avio_flush(ctx->output_ctx->pb);
+        ctx->sink->packet(ctx->sink->opaque, key, ctx->packet->pts);
+        // Every segment has to start with PAT and PMT, the built-in muxer always does that
+        if (key && !ctx->tsmux)
+            av_opt_set(ctx->output_ctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+    }
     // printf("sendframe w=%d h=%d, pktsize=%d\n", ctx->frame->width, ctx->frame->height, ctx->packet->size);
-    if (av_interleaved_write_frame(ctx->output_ctx, ctx->packet) < 0)
+    if (write_frame(ctx, ctx->packet) < 0)
     {
         av_packet_unref(ctx->packet);
         return -1;
     }
     av_packet_unref(ctx->packet);
-
-    // Update the frame timestamp
-    ctx->frame->pts += 90000 / opt.fps;
     return 0;
 }
 
+// Without data, silence is encoded
 int sendaudioframe(struct ctx *ctx, const short *data)
 {
+    static const short silence[AUFRAMELEN * 2];
     int len = AUFRAMELEN;
     float *bufl = (float *)ctx->auframe->data[0];
     float *bufr = (float *)ctx->auframe->data[1];
 
+    if (!data)
+        data = silence;
     for (int i = 0; i < len; i++)
     {
         bufl[i] = data[2 * i] / 32768.0f;
@@ -386,7 +754,7 @@ int sendaudioframe(struct ctx *ctx, const short *data)
     }
     ctx->aupacket->stream_index = ctx->audio_stream->index;
     // printf("ausendframe %d pktsize=%d pts=%ld\n", ctx->aupacket->stream_index, ctx->aupacket->size, ctx->aupacket->pts);
-    if (av_interleaved_write_frame(ctx->output_ctx, ctx->aupacket) < 0)
+    if (write_frame(ctx, ctx->aupacket) < 0)
     {
         av_packet_unref(ctx->aupacket);
         return -1;
@@ -400,7 +768,10 @@ int sendaudioframe(struct ctx *ctx, const short *data)
 
 void close_encoder(struct ctx *ctx)
 {
-    av_write_trailer(ctx->output_ctx);
+    if (ctx->tsmux)
+        tsmux_close(ctx->tsmux);
+    else
+        av_write_trailer(ctx->output_ctx);
     avio_context_free(&ctx->output_ctx->pb);
     av_freep(&ctx->avio_ctx_buffer);
     av_packet_free(&ctx->packet);
@@ -408,10 +779,13 @@ void close_encoder(struct ctx *ctx)
     av_packet_free(&ctx->aupacket);
     av_frame_free(&ctx->auframe);
     avcodec_free_context(&ctx->videoenc_ctx);
+    if (ctx->budgeted)
+        budget_update(-1);
     if (ctx->audioenc_ctx)
         avcodec_free_context(&ctx->audioenc_ctx);
     avformat_free_context(ctx->output_ctx);
-    sws_freeContext(ctx->sws);
+    for (int i = 0; i < SCALER_CACHE_SIZE; i++)
+        sws_freeContext(ctx->scalers[i].sws);
     free(ctx);
 }
 
@@ -432,107 +806,835 @@ int error_handler(Display *display, XErrorEvent *event)
     return 0;
 }
 
-int serve(int sk, const char *name)
+// The stream name is <window ID in hex>/<title> or just the title
+Window find_stream_window(const char *name)
 {
-    Display *display = XOpenDisplay(NULL);
-    Window w;
+    struct catalog_item item;
+    char *end;
+    Window w = strtoul(name, &end, 16);
+
+    if (end != name && *end == '/')
+    {
+        if (catalog_lookup(w, &item))
+            return 0;
+        printf("Returned window %s\n", item.title);
+        return w;
+    }
+    return catalog_find(name);
+}
+
+struct stream_params
+{
+    // Region of the window to capture, width 0 for the whole window
+    int x, y, cwidth, cheight;
+    // Rendition
+    int width, height, fps, bitrate;
+};
+
+// Output of the encoder waiting to be sent to a client, a piece of the stream or the start of a
+// video packet
+struct chunk
+{
+    struct chunk *next;
+    int packet, key;
+    int64_t pts;
+    int len;
+    uint8_t data[];
+};
+
+// Clients of the same window share one capture thread, and clients asking for the same
+// rendition of it share one encoder thread, whose output is sent to all of them
+struct client
+{
+    struct sink *sink;
+    // New clients wait for the next keyframe, the encoder thread removes done clients
+    int waiting, done, removed;
+    // The encoder thread queues the output and the thread of the client sends it, so a slow
+    // client never holds up the encoder. The queue is protected by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct chunk *head, **tail;
+    size_t queued;
+    struct client *next;
+};
+
+struct rendition
+{
+    // Session ID in the control API
+    unsigned id;
+    int width, height, fps, bitrate, gop;
+    struct source *source;
+    // Fans the encoder output out to the clients, which are protected by write_mutex
+    struct sink sink;
     struct ctx *ctx;
-    void *au = 0;
-    short aubuf[AUFRAMELEN * 2];
+    pthread_mutex_t write_mutex;
+    struct client *clients;
+    // Last job done, and keyframes requested by joining clients and sent
+    unsigned job, key_requests, key_sent;
+    // Time stamp of the last keyframe. With a keyframe interval, keyframes come after that much
+    // time, also when static content skips frames
+    int64_t key_pts;
+    // The frame buffer is older than the last captured image
+    int dirty;
+    // Tiles of the image changed since the last encoded frame
+    unsigned char *tiles;
+    int tile_columns, tile_rows;
+    double start_time, next_frame, last_frame;
+    // Last time the rendition had clients
+    double client_time;
+    // Settings changed through the control API, applied by the rendition thread, and the preset
+    // asked for, PRESET_UNCHANGED, PRESET_AUTO or an index in presets
+    int reconfigure, preset_request, mute;
+    struct rendition *next;
+};
+
+struct source
+{
+    Window w;
+    int x, y, cwidth, cheight;
+    void *au;
+    // Current job, valid until all the renditions are done with it
+    XImage *image;
+    // Tiles of the image changed since the previous job
+    int changed, tile_columns, tile_rows;
+    const unsigned char *tiles;
+    short audio[MAX_JOB_AUFRAMES][AUFRAMELEN * 2];
+    int naudio;
+    double time;
+    unsigned job;
+    int pending, stopped;
+    struct rendition *renditions;
+    struct source *next;
+};
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+static struct source *sources;
+static unsigned rendition_ids;
 
-    if (!display)
+// A client with more than CLIENT_QUEUE bytes not sent is dropped
+static void queue_chunk(struct client *c, struct chunk *chunk)
+{
+    pthread_mutex_lock(&c->mutex);
+    if (!c->done && c->queued + chunk->len > CLIENT_QUEUE)
     {
-        fprintf(stderr, "Cannot open display\n");
-        return -1;
+        fprintf(stderr, "Client does not keep up with the stream, dropped\n");
+        c->done = 1;
     }
-    XWindowAttributes wattr;
-    XSetErrorHandler(error_handler);
-    w = findWindowByName(display, name);
-    if (!w)
+    if (c->done)
+        free(chunk);
+    else
     {
-        fprintf(stderr, "Window not found\n");
-        return -1;
+        chunk->next = 0;
+        *c->tail = chunk;
+        c->tail = &chunk->next;
+        c->queued += chunk->len;
+        pthread_cond_signal(&c->cond);
     }
+    pthread_mutex_unlock(&c->mutex);
+}
 
-    XGetWindowAttributes(display, w, &wattr);
+static int fanout_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct rendition *r = (struct rendition *)opaque;
 
-    printf("Window width=%d height=%d\n", wattr.width, wattr.height);
-    const char *reply = "HTTP/1.1 200 OK\r\nContent-Type: video/MP2T\r\nConnection: close\r\n\r\n";
-    send(sk, reply, strlen(reply), 0);
-    if (*opt.recdevice)
-        au = au_open_record(opt.recdevice, 48000, 2, AUFRAMELEN * 4, 0);
-    ctx = open_encoder(sk, wattr.width, wattr.height, opt.width, opt.height, opt.fps, opt.bitrate, au ? 96000 : 0);
-    if (ctx)
+    pthread_mutex_lock(&r->write_mutex);
+    for (struct client *c = r->clients; c; c = c->next)
+        if (!c->waiting)
+        {
+            struct chunk *chunk = (struct chunk *)malloc(sizeof(*chunk) + buf_size);
+
+            *chunk = (struct chunk){0, 0, 0, 0, buf_size};
+            memcpy(chunk->data, buf, buf_size);
+            queue_chunk(c, chunk);
+        }
+    pthread_mutex_unlock(&r->write_mutex);
+    return buf_size;
+}
+
+static void fanout_packet(void *opaque, int key, int64_t pts)
+{
+    struct rendition *r = (struct rendition *)opaque;
+
+    if (key)
+        r->key_pts = pts;
+    pthread_mutex_lock(&r->write_mutex);
+    for (struct client *c = r->clients; c; c = c->next)
     {
-        double start = seconds();
-        uint64_t asamples = 0;
-        unsigned frameno = 0;
+        if (key)
+            c->waiting = 0;
+        if (!c->waiting && c->sink->packet)
+        {
+            struct chunk *chunk = (struct chunk *)malloc(sizeof(*chunk));
 
-        for (;;)
+            *chunk = (struct chunk){0, 1, key, pts, 0};
+            queue_chunk(c, chunk);
+        }
+    }
+    pthread_mutex_unlock(&r->write_mutex);
+}
+
+// Remove stopped and failed clients, or all of them, session_mutex has to be held
+static void remove_clients(struct rendition *r, int all)
+{
+    struct client **p = &r->clients;
+
+    pthread_mutex_lock(&r->write_mutex);
+    while (*p)
+    {
+        struct client *c = *p;
+
+        pthread_mutex_lock(&c->mutex);
+        if (all || c->done || (c->sink->stopped && c->sink->stopped(c->sink->opaque)))
         {
-            if (!XGetWindowAttributes(display, w, &wattr))
-            {
-                fprintf(stderr, "XGetWindowAttributes failed\n");
-                break;
-            }
-            if (wattr.width != ctx->iwidth || wattr.height != ctx->iheight)
+            // The client thread sends what is queued and returns, c is not used after this
+            *p = c->next;
+            c->removed = 1;
+            pthread_cond_signal(&c->cond);
+        }
+        else
+            p = &c->next;
+        pthread_mutex_unlock(&c->mutex);
+    }
+    pthread_mutex_unlock(&r->write_mutex);
+    pthread_cond_broadcast(&session_cond);
+}
+
+// Add the tiles changed in the captured image to the ones changed since the last encoded frame
+static void merge_tiles(struct rendition *r, const struct source *s)
+{
+    int n = s->tile_columns * s->tile_rows;
+
+    if (r->tile_columns != s->tile_columns || r->tile_rows != s->tile_rows)
+    {
+        free(r->tiles);
+        r->tiles = (unsigned char *)malloc(n);
+        memset(r->tiles, 1, n);
+        r->tile_columns = s->tile_columns;
+        r->tile_rows = s->tile_rows;
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        r->tiles[i] |= s->tiles[i];
+}
+
+static int encode_job(struct rendition *r, unsigned key_requests)
+{
+    struct source *s = r->source;
+    XImage *image = s->image;
+
+    if (!r->ctx)
+    {
+        r->ctx = open_encoder(&r->sink, image->width, image->height, r->width, r->height, r->fps, r->bitrate,
+                              s->au ? 96000 : 0);
+        if (!r->ctx)
+        {
+            fprintf(stderr, "Error opening encoder\n");
+            return -1;
+        }
+        r->start_time = r->next_frame = s->time;
+        r->last_frame = s->time - STATIC_INTERVAL;
+        r->dirty = 1;
+    }
+    if (s->changed > 0)
+    {
+        r->dirty = 1;
+        merge_tiles(r, s);
+    }
+    // Renditions with a lower frame rate skip captured frames, and nothing is converted or encoded
+    // for unchanged content, except for keyframes and a repeated frame every STATIC_INTERVAL
+    if (s->time >= r->next_frame - 0.5 / r->fps)
+    {
+        int64_t pts = (int64_t)((s->time - r->start_time) * 90000);
+        int key_due = r->gop && pts - r->key_pts >= (int64_t)r->gop * 90000 / r->fps;
+
+        r->next_frame += 1.0 / r->fps;
+        if (r->next_frame < s->time)
+            r->next_frame = s->time;
+        if (r->dirty || r->key_sent != key_requests || key_due || s->time - r->last_frame >= STATIC_INTERVAL)
+        {
+            if (r->key_sent != key_requests || key_due)
             {
-                ctx->iwidth = wattr.width;
-                ctx->iheight = wattr.height;
-                sws_freeContext(ctx->sws);
-                printf("Window changed dimensions to w=%d h=%d\n", wattr.width, wattr.height);
-                ctx->sws = sws_getContext(wattr.width, wattr.height, AV_PIX_FMT_BGRA, opt.width, opt.height, AV_PIX_FMT_YUV420P, SWS_BICUBIC | PP_CPU_CAPS_MMX | PP_CPU_CAPS_MMX2, 0, 0, 0);
+                r->ctx->frame->pict_type = AV_PICTURE_TYPE_I;
+                r->key_sent = key_requests;
             }
-            XImage *image = XGetImage(display, w, 0, 0, ctx->iwidth, ctx->iheight, AllPlanes, ZPixmap);
-            if (!image)
+            // The time stamps follow the capture time, so they stay continuous over skipped frames
+            if (sendframe(r->ctx, r->dirty ? image->data : 0, image->width, image->height, image->bytes_per_line, pts,
+                          r->tiles, r->tile_columns, r->tile_rows))
+                return -1;
+            r->ctx->frame->pict_type = AV_PICTURE_TYPE_NONE;
+            if (r->tiles)
+                memset(r->tiles, 0, r->tile_columns * r->tile_rows);
+            r->last_frame = s->time;
+            // A frame scaled while the size changed, maybe only in part, is scaled again until
+            // the good scaler takes over
+            r->dirty = r->ctx->scaler && r->ctx->scaler->flags != SCALER_FLAGS;
+        }
+    }
+    for (int i = 0; i < s->naudio; i++)
+        if (sendaudioframe(r->ctx, r->mute ? 0 : s->audio[i]))
+            return -1;
+    // Static content is encoded twice a second, the built-in muxer sends the PCR and the tables
+    // in between
+    if (r->ctx->tsmux && tsmux_write_time(r->ctx->tsmux, (int64_t)((s->time - r->start_time) * 90000)))
+        return -1;
+    return 0;
+}
+
+// Apply the settings changed through the control API
+static void reconfigure_rendition(struct rendition *r, const struct stream_params *params, int preset)
+{
+    struct ctx *ctx = r->ctx;
+
+    if (preset == PRESET_AUTO)
+        ctx->preset_fixed = 0;
+    else if (preset != PRESET_UNCHANGED)
+        ctx->preset_fixed = 1;
+    if (preset < 0)
+        preset = ctx->preset;
+    if (reopen_video_encoder(ctx, params->width, params->height, params->fps, params->bitrate, preset,
+                             budget_threads()))
+        fprintf(stderr, "Failed to change the encoder settings\n");
+    // The frame is converted again, at the new size too
+    r->dirty = 1;
+}
+
+static void *rendition_thread(void *arg)
+{
+    struct rendition *r = (struct rendition *)arg;
+    struct source *s = r->source;
+    struct rendition **p;
+
+    pthread_mutex_lock(&session_mutex);
+    for (;;)
+    {
+        unsigned key_requests;
+        int fail, active, reconfigure, preset;
+        struct stream_params params;
+
+        while (r->job == s->job && !s->stopped)
+            pthread_cond_wait(&session_cond, &session_mutex);
+        active = r->clients != 0;
+        if (active)
+            r->client_time = s->time;
+        if (s->stopped || (!active && s->time - r->client_time >= SESSION_LINGER))
+            break;
+        r->job = s->job;
+        key_requests = r->key_requests;
+        // Changes wait for the encoder to be opened, it is opened with the new size and rate anyway
+        reconfigure = r->reconfigure && r->ctx;
+        preset = r->preset_request;
+        if (reconfigure)
+        {
+            params = (struct stream_params){0, 0, 0, 0, r->width, r->height, r->fps, r->bitrate};
+            r->reconfigure = 0;
+            r->preset_request = PRESET_UNCHANGED;
+        }
+        pthread_mutex_unlock(&session_mutex);
+        if (reconfigure)
+            reconfigure_rendition(r, &params, preset);
+        // Without clients the encoder is kept open, but nothing is encoded. The frame
+        // is converted again for the next client, which gets a keyframe
+        if (r->ctx)
+            budget_set_active(r->ctx, active);
+        if (active)
+            fail = encode_job(r, key_requests);
+        else
+        {
+            r->dirty = 1;
+            fail = 0;
+        }
+        pthread_mutex_lock(&session_mutex);
+        remove_clients(r, fail);
+        s->pending--;
+    }
+    // When the window goes away, the clients get the end of the stream before they are removed.
+    // No client joins a stopped source
+    if (s->stopped && r->ctx)
+    {
+        struct ctx *ctx = r->ctx;
+
+        // The status reads the encoder of the listed renditions
+        r->ctx = 0;
+        pthread_mutex_unlock(&session_mutex);
+        close_encoder(ctx);
+        pthread_mutex_lock(&session_mutex);
+    }
+    remove_clients(r, 1);
+    // A job may have been started after the last client went away
+    if (r->job != s->job)
+        s->pending--;
+    for (p = &s->renditions; *p; p = &(*p)->next)
+        if (*p == r)
+        {
+            *p = r->next;
+            break;
+        }
+    pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_mutex);
+    if (r->ctx)
+        close_encoder(r->ctx);
+    pthread_mutex_destroy(&r->write_mutex);
+    free(r->tiles);
+    free(r);
+    return 0;
+}
+
+static void *capture_thread(void *arg)
+{
+    struct source *s = (struct source *)arg;
+    Display *display = xconn_acquire();
+    struct capture *capture = 0;
+    XWindowAttributes wattr;
+    double start = seconds(), next = start;
+    uint64_t asamples = 0;
+    struct source **p;
+
+    // The attributes of the window come from its events, it is not asked for them every frame
+    if (display && !catalog_watch(s->w))
+    {
+        capture = capture_open(display, s->w);
+        if (*opt.recdevice)
+            s->au = au_open_record(opt.recdevice, 48000, 2, AUFRAMELEN * 4, 0);
+    }
+    for (;;)
+    {
+        XImage *image = 0;
+        int fps = 0, naudio = 0, max_width = 0, max_height = 0;
+
+        // Capture at the highest frame rate and size asked for
+        pthread_mutex_lock(&session_mutex);
+        for (struct rendition *r = s->renditions; r; r = r->next)
+        {
+            if (r->fps > fps)
+                fps = r->fps;
+            if (r->width > max_width)
+                max_width = r->width;
+            if (r->height > max_height)
+                max_height = r->height;
+        }
+        pthread_mutex_unlock(&session_mutex);
+        if (fps && capture)
+        {
+            if (catalog_geometry(s->w, &wattr))
+                fprintf(stderr, "Window closed\n");
+            else
             {
-                fprintf(stderr, "XGetImage failed\n");
-                break;
+                // Only the region is read, clipped to the window
+                int width = s->cwidth ? s->cwidth : wattr.width, height = s->cheight ? s->cheight : wattr.height;
+                int cwidth = width, cheight = height;
+
+                if (s->x + cwidth > wattr.width)
+                    cwidth = wattr.width - s->x;
+                if (s->y + cheight > wattr.height)
+                    cheight = wattr.height - s->y;
+                // A black frame is sent while the window or the region cannot be seen
+                if (wattr.map_state == IsViewable && cwidth > 0 && cheight > 0)
+                    image = capture_get(capture, &wattr, s->x, s->y, cwidth, cheight, max_width, max_height);
+                if (!image)
+                    image = capture_blank(capture, &wattr, width, height, max_width, max_height);
+                if (image)
+                    s->changed = capture_changes(capture, image, &s->tiles, &s->tile_columns, &s->tile_rows);
             }
-            if (sendframe(ctx, image->data))
+            next += 1.0 / fps;
+        }
+        // Audio is read up to the time of the frame, so it paces the capture when present
+        while (image && s->au && naudio < MAX_JOB_AUFRAMES && asamples / 48000.0 < next - start)
+        {
+            if (au_get(s->au, s->audio[naudio]) < 0)
             {
-                XDestroyImage(image);
+                image = 0;
                 break;
             }
-            frameno++;
-            XDestroyImage(image);
-            if (au)
-            {
-                int fail = 0;
-                while (asamples / 48000.0 < (double)frameno / opt.fps)
+            naudio++;
+            asamples += AUFRAMELEN;
+        }
+
+        pthread_mutex_lock(&session_mutex);
+        if (!image || !s->renditions)
+        {
+            // The renditions end with all their clients
+            s->stopped = 1;
+            pthread_cond_broadcast(&session_cond);
+            while (s->renditions)
+                pthread_cond_wait(&session_cond, &session_mutex);
+            for (p = &sources; *p; p = &(*p)->next)
+                if (*p == s)
                 {
-                    if (au_get(au, aubuf) < 0)
-                    {
-                        fail = 1;
-                        break;
-                    }
-                    if (sendaudioframe(ctx, aubuf))
-                    {
-                        fail = 1;
-                        break;
-                    }
-                    asamples += 1024;
-                }
-                if (fail)
+                    *p = s->next;
                     break;
-            }
+                }
+            pthread_mutex_unlock(&session_mutex);
+            break;
+        }
+        // Post the job to all the renditions, they encode in parallel
+        s->image = image;
+        s->naudio = naudio;
+        s->time = next - start;
+        s->job++;
+        s->pending = 0;
+        for (struct rendition *r = s->renditions; r; r = r->next)
+            s->pending++;
+        pthread_cond_broadcast(&session_cond);
+        while (s->pending)
+            pthread_cond_wait(&session_cond, &session_mutex);
+        s->image = 0;
+        pthread_mutex_unlock(&session_mutex);
+        if (!s->au)
+            while (seconds() < next)
+                usleep(10000);
+    }
+    if (s->au)
+        au_close(s->au);
+    if (capture)
+        capture_close(capture);
+    if (display)
+    {
+        catalog_unwatch(s->w);
+        xconn_release(display);
+    }
+    free(s);
+    return 0;
+}
+
+// Send the window to the sink until it fails or is stopped
+int stream_window(Window w, struct sink *sink, const struct stream_params *params)
+{
+    struct client client = {sink, 1};
+    struct source *s;
+    struct rendition *r;
+    pthread_t thread;
+
+    pthread_mutex_lock(&session_mutex);
+    for (s = sources; s; s = s->next)
+        if (s->w == w && s->x == params->x && s->y == params->y && s->cwidth == params->cwidth &&
+            s->cheight == params->cheight && !s->stopped)
+            break;
+    if (!s)
+    {
+        s = (struct source *)calloc(1, sizeof(*s));
+        s->w = w;
+        s->x = params->x;
+        s->y = params->y;
+        s->cwidth = params->cwidth;
+        s->cheight = params->cheight;
+        if (pthread_create(&thread, NULL, capture_thread, s) != 0)
+        {
+            perror("pthread_create");
+            pthread_mutex_unlock(&session_mutex);
+            free(s);
+            return -1;
+        }
+        pthread_detach(thread);
+        s->next = sources;
+        sources = s;
+    }
+    for (r = s->renditions; r; r = r->next)
+        if (r->width == params->width && r->height == params->height && r->fps == params->fps &&
+            r->bitrate == params->bitrate && r->gop == sink->gop)
+            break;
+    if (!r)
+    {
+        r = (struct rendition *)calloc(1, sizeof(*r));
+        *r = (struct rendition){++rendition_ids, params->width, params->height, params->fps, params->bitrate,
+                                sink->gop, s, {fanout_write, fanout_packet, 0, r, sink->gop}};
+        r->job = s->job;
+        r->preset_request = PRESET_UNCHANGED;
+        r->mute = opt.mute;
+        pthread_mutex_init(&r->write_mutex, 0);
+        if (pthread_create(&thread, NULL, rendition_thread, r) != 0)
+        {
+            perror("pthread_create");
+            pthread_mutex_unlock(&session_mutex);
+            free(r);
+            return -1;
+        }
+        pthread_detach(thread);
+        r->next = s->renditions;
+        s->renditions = r;
+    }
+    pthread_mutex_init(&client.mutex, 0);
+    pthread_cond_init(&client.cond, 0);
+    client.tail = &client.head;
+    pthread_mutex_lock(&r->write_mutex);
+    client.next = r->clients;
+    r->clients = &client;
+    pthread_mutex_unlock(&r->write_mutex);
+    // The new client starts with a keyframe
+    r->key_requests++;
+    pthread_mutex_unlock(&session_mutex);
+
+    // Send the output until the client is removed and everything queued before is sent
+    pthread_mutex_lock(&client.mutex);
+    for (;;)
+    {
+        struct chunk *chunk;
+        int fail = 0;
+
+        while (!client.head && !client.removed)
+            pthread_cond_wait(&client.cond, &client.mutex);
+        if (!(chunk = client.head))
+            break;
+        if (!(client.head = chunk->next))
+            client.tail = &client.head;
+        client.queued -= chunk->len;
+        if (!client.done)
+        {
+            pthread_mutex_unlock(&client.mutex);
+            if (chunk->packet)
+                sink->packet(sink->opaque, chunk->key, chunk->pts);
             else
-                while (seconds() < start + (double)frameno / opt.fps)
-                    usleep(10000);
+                fail = sink->write(sink->opaque, chunk->data, chunk->len) < 0;
+            pthread_mutex_lock(&client.mutex);
         }
-        close_encoder(ctx);
+        if (fail)
+            client.done = 1;
+        free(chunk);
+    }
+    pthread_mutex_unlock(&client.mutex);
+    pthread_mutex_destroy(&client.mutex);
+    pthread_cond_destroy(&client.cond);
+    return 0;
+}
+
+// The defaults are changed through the control API under session_mutex
+void default_stream_params(struct stream_params *params)
+{
+    pthread_mutex_lock(&session_mutex);
+    *params = (struct stream_params){0, 0, 0, 0, opt.width, opt.height, opt.fps, opt.bitrate};
+    pthread_mutex_unlock(&session_mutex);
+}
+
+// Keep the parameters in the range the encoder and the capture accept
+static void clamp_stream_params(struct stream_params *params)
+{
+    params->x = params->x < 0 ? 0 : params->x;
+    params->y = params->y < 0 ? 0 : params->y;
+    params->cwidth = params->cwidth < 0 ? 0 : params->cwidth;
+    params->cheight = params->cheight < 0 ? 0 : params->cheight;
+    // The encoder needs even dimensions
+    params->width = params->width < 16 ? 16 : params->width > 4096 ? 4096 : params->width & ~1;
+    params->height = params->height < 16 ? 16 : params->height > 4096 ? 4096 : params->height & ~1;
+    params->fps = params->fps < 1 ? 1 : params->fps > 120 ? 120 : params->fps;
+    params->bitrate = params->bitrate < 50000 ? 50000 : params->bitrate;
+}
+
+// Parse a query like w=1280&h=720&fps=15&br=1500000. With x or y, w and h are the size of the
+// captured region and ow and oh set the output size
+void parse_stream_params(const char *query, struct stream_params *params)
+{
+    int w = 0, h = 0, ow = 0, oh = 0, crop = 0;
+
+    while (query && *query)
+    {
+        if (sscanf(query, "x=%d", &params->x) == 1 || sscanf(query, "y=%d", &params->y) == 1)
+            crop = 1;
+        sscanf(query, "w=%d", &w);
+        sscanf(query, "h=%d", &h);
+        sscanf(query, "ow=%d", &ow);
+        sscanf(query, "oh=%d", &oh);
+        sscanf(query, "fps=%d", &params->fps);
+        sscanf(query, "br=%d", &params->bitrate);
+        query = strchr(query, '&');
+        if (query)
+            query++;
+    }
+    if (crop)
+    {
+        params->cwidth = w;
+        params->cheight = h;
+    }
+    else if (w && h)
+    {
+        params->width = w;
+        params->height = h;
+    }
+    if (ow && oh)
+    {
+        params->width = ow;
+        params->height = oh;
+    }
+    clamp_stream_params(params);
+}
+
+// Rendition i as listed in Browse, 0 is the default one
+int get_rendition(int i, int *width, int *height, int *bitrate)
+{
+    if (i < 0 || i > opt.nladder)
+        return -1;
+    pthread_mutex_lock(&session_mutex);
+    *width = i ? opt.ladder[i - 1].width : opt.width;
+    *height = i ? opt.ladder[i - 1].height : opt.height;
+    *bitrate = i ? opt.ladder[i - 1].bitrate : opt.bitrate;
+    pthread_mutex_unlock(&session_mutex);
+    return 0;
+}
+
+// Sessions are the renditions being encoded, listed with the defaults of new ones
+int control_status(char *buf, size_t size)
+{
+    const char *sep = "";
+    size_t len;
+
+    pthread_mutex_lock(&session_mutex);
+    len = snprintf(buf, size, "{\"width\": %d, \"height\": %d, \"fps\": %d, \"bitrate\": %d, \"audio\": %s, "
+                              "\"sessions\": [",
+                   opt.width, opt.height, opt.fps, opt.bitrate, opt.mute ? "false" : "true");
+    for (struct source *s = sources; s && len < size; s = s->next)
+        for (struct rendition *r = s->renditions; r && len < size; r = r->next)
+        {
+            int clients = 0;
+
+            for (struct client *c = r->clients; c; c = c->next)
+                clients++;
+            len += snprintf(buf + len, size - len,
+                            "%s\n{\"session\": %u, \"window\": \"0x%lx\", \"x\": %d, \"y\": %d, \"cwidth\": %d, "
+                            "\"cheight\": %d, \"width\": %d, \"height\": %d, \"fps\": %d, \"bitrate\": %d, "
+                            "\"preset\": \"%s\", \"preset_auto\": %s, \"audio\": %s, \"clients\": %d}",
+                            sep, r->id, s->w, s->x, s->y, s->cwidth, s->cheight, r->width, r->height, r->fps,
+                            r->bitrate, presets[r->ctx ? r->ctx->preset : 0],
+                            r->ctx && r->ctx->preset_fixed ? "false" : "true", r->mute ? "false" : "true", clients);
+            sep = ",";
+        }
+    if (len < size)
+        len += snprintf(buf + len, size - len, "\n]}\n");
+    pthread_mutex_unlock(&session_mutex);
+    return len < size ? len : size - 1;
+}
+
+// Change one session, or all of them and the defaults. The encoders are reopened by their
+// threads before the next frame, which is an IDR frame then
+int control_apply(const struct control_change *change)
+{
+    int preset = PRESET_UNCHANGED, found = 0;
+    int video = change->width || change->height || change->fps || change->bitrate || *change->preset;
+
+    if (!strcmp(change->preset, "auto"))
+        preset = PRESET_AUTO;
+    else if (*change->preset)
+    {
+        for (int i = 0; i < (int)(sizeof(presets) / sizeof(presets[0])); i++)
+            if (!strcmp(presets[i], change->preset))
+                preset = i;
+        if (preset < 0)
+            return -2;
+    }
+    pthread_mutex_lock(&session_mutex);
+    if (!change->session)
+    {
+        struct stream_params params = {0, 0, 0, 0, opt.width, opt.height, opt.fps, opt.bitrate};
+
+        params.width = change->width ? change->width : params.width;
+        params.height = change->height ? change->height : params.height;
+        params.fps = change->fps ? change->fps : params.fps;
+        params.bitrate = change->bitrate ? change->bitrate : params.bitrate;
+        clamp_stream_params(&params);
+        opt.width = params.width;
+        opt.height = params.height;
+        opt.fps = params.fps;
+        opt.bitrate = params.bitrate;
+        if (change->audio >= 0)
+            opt.mute = !change->audio;
+    }
+    for (struct source *s = sources; s; s = s->next)
+        for (struct rendition *r = s->renditions; r; r = r->next)
+        {
+            struct stream_params params = {0, 0, 0, 0, r->width, r->height, r->fps, r->bitrate};
+
+            if (change->session && r->id != (unsigned)change->session)
+                continue;
+            found = 1;
+            params.width = change->width ? change->width : params.width;
+            params.height = change->height ? change->height : params.height;
+            params.fps = change->fps ? change->fps : params.fps;
+            params.bitrate = change->bitrate ? change->bitrate : params.bitrate;
+            clamp_stream_params(&params);
+            r->width = params.width;
+            r->height = params.height;
+            r->fps = params.fps;
+            r->bitrate = params.bitrate;
+            if (video)
+                r->reconfigure = 1;
+            if (preset != PRESET_UNCHANGED)
+                r->preset_request = preset;
+            if (change->audio >= 0)
+                r->mute = !change->audio;
+        }
+    pthread_mutex_unlock(&session_mutex);
+    return change->session && !found ? -1 : 0;
+}
+
+int serve(int sk, const char *path)
+{
+    struct sink sink = {write_packet, 0, 0, (void *)(size_t)sk, 0};
+    struct stream_params params;
+    char name[300], *query;
+    Window w;
+
+    default_stream_params(&params);
+    snprintf(name, sizeof(name), "%s", path);
+    if ((query = strchr(name, '?')))
+    {
+        *query++ = 0;
+        parse_stream_params(query, &params);
+    }
+    w = find_stream_window(name);
+    if (!w)
+    {
+        fprintf(stderr, "Window not found\n");
+        return -1;
+    }
+    const char *reply = "HTTP/1.1 200 OK\r\nContent-Type: video/MP2T\r\nConnection: close\r\n\r\n";
+    send(sk, reply, strlen(reply), 0);
+    return stream_window(w, &sink, &params);
+}
+
+// Segments start at keyframes, so the keyframe interval is the segment duration
+int serve_hls(const char *name, struct hls_stream *hls)
+{
+    struct sink sink = {hls_write, hls_packet, hls_idle, hls, 0};
+    struct stream_params params;
+    Window w = find_stream_window(name);
+
+    if (!w)
+    {
+        fprintf(stderr, "Window not found\n");
+        return -1;
+    }
+    default_stream_params(&params);
+    sink.gop = HLS_SEGMENT_DURATION * params.fps;
+    return stream_window(w, &sink, &params);
+}
+
+// The multicast stream and the recording run for the whole life of the program, they are restarted
+// when the source goes away. Both use the default rendition, so they share one encoder
+void *output_thread(void *arg)
+{
+    struct sink *sink = (struct sink *)arg;
+    struct stream_params params;
+
+    default_stream_params(&params);
+    for (;;)
+    {
+        Window w = find_stream_window(opt.multicast_source);
+
+        if (w)
+        {
+            if (sink->restart)
+                sink->restart(sink->opaque);
+            stream_window(w, sink, &params);
+        }
+        else
+            fprintf(stderr, "Source %s not found\n", opt.multicast_source);
+        sleep(1);
     }
-    else
-        fprintf(stderr, "Error opening encoder\n");
-    if (au)
-        au_close(au);
-    XCloseDisplay(display);
     return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    opt = (struct opt){30, 2000000, 1920, 1080, 8080};
+    opt = (struct opt){30, 2000000, 1920, 1080, 8080, "", "", "Desktop"};
+    opt.record_minutes = 60;
     for (int i = 1; i < argc; i++)
     {
         if (!strcmp(argv[i], "-H") || !strcmp(argv[i], "--help"))
@@ -545,6 +1647,15 @@ int main(int argc, char *argv[])
             printf("        -h <height>, --height <height>     Output height, default 1080\n");
             printf("        -p <port>, --port <port>           Local TCP port for the HTTP server, default 8080\n");
             printf("        -a <device>, --audiodev <device>   Name of the audio device for sending audio, default none\n");
+            printf("        -m <url>, --multicast <url>        Also send to rtp://<group>:<port> or udp://<group>:<port>\n");
+            printf("        -s <window>, --source <window>     Window sent to the multicast group and recorded, default Desktop\n");
+            printf("        -r <dir>, --record <dir>           Record into files of %d seconds in the directory\n", RECORD_SEGMENT);
+            printf("        -k <minutes>, --keep <minutes>     Minutes of recording kept, default 60\n");
+            printf("        -l <list>, --ladder <list>         Additional renditions like 1280x720@1500000,854x480@800000\n");
+            printf("        -c <region>, --crop <region>       List a region like 1280x720+0+0 or 1280x720+0+0@<window> in Browse\n");
+            printf("        -L, --letterbox                    Keep the aspect ratio with black bars\n");
+            printf("        -Z, --lowlatency                   Send every frame as soon as it is encoded\n");
+            printf("        -T, --tsmux                        Use the built-in MPEG-TS muxer instead of libavformat\n");
             return 0;
         }
         else if ((!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bitrate")) && i + 1 < argc)
@@ -559,6 +1670,76 @@ int main(int argc, char *argv[])
             opt.local_port = atoi(argv[++i]);
         else if ((!strcmp(argv[i], "-a") || !strcmp(argv[i], "--audiodev")) && i + 1 < argc)
             strcpy(opt.recdevice, argv[++i]);
+        else if ((!strcmp(argv[i], "-m") || !strcmp(argv[i], "--multicast")) && i + 1 < argc)
+            snprintf(opt.multicast, sizeof(opt.multicast), "%s", argv[++i]);
+        else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--source")) && i + 1 < argc)
+            strcpysafechars(opt.multicast_source, argv[++i]);
+        else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--record")) && i + 1 < argc)
+            snprintf(opt.record, sizeof(opt.record), "%s", argv[++i]);
+        else if ((!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep")) && i + 1 < argc)
+            opt.record_minutes = atoi(argv[++i]);
+        else if ((!strcmp(argv[i], "-l") || !strcmp(argv[i], "--ladder")) && i + 1 < argc)
+        {
+            for (const char *p = argv[++i]; p && opt.nladder < MAX_LADDER; p = strchr(p, ','))
+            {
+                struct stream_params params;
+
+                if (*p == ',')
+                    p++;
+                default_stream_params(&params);
+                if (sscanf(p, "%dx%d@%d", &params.width, &params.height, &params.bitrate) < 2)
+                    continue;
+                clamp_stream_params(&params);
+                opt.ladder[opt.nladder].width = params.width;
+                opt.ladder[opt.nladder].height = params.height;
+                opt.ladder[opt.nladder].bitrate = params.bitrate;
+                opt.nladder++;
+            }
+        }
+        else if (!strcmp(argv[i], "-L") || !strcmp(argv[i], "--letterbox"))
+            opt.letterbox = 1;
+        else if (!strcmp(argv[i], "-Z") || !strcmp(argv[i], "--lowlatency"))
+            opt.low_latency = 1;
+        else if (!strcmp(argv[i], "-T") || !strcmp(argv[i], "--tsmux"))
+            opt.tsmux = 1;
+        else if ((!strcmp(argv[i], "-c") || !strcmp(argv[i], "--crop")) && i + 1 < argc && opt.ncrops < MAX_CROPS)
+        {
+            const char *source = strchr(argv[++i], '@');
+
+            if (sscanf(argv[i], "%dx%d+%d+%d", &opt.crops[opt.ncrops].width, &opt.crops[opt.ncrops].height,
+                       &opt.crops[opt.ncrops].x, &opt.crops[opt.ncrops].y) == 4 &&
+                opt.crops[opt.ncrops].width > 0 && opt.crops[opt.ncrops].height > 0)
+            {
+                strcpysafechars(opt.crops[opt.ncrops].source, source ? source + 1 : "Desktop");
+                opt.ncrops++;
+            }
+        }
+    }
+    if (xconn_init())
+        return -1;
+    XSetErrorHandler(error_handler);
+    if (catalog_start(upnp_content_changed))
+        return -1;
+    if (*opt.multicast)
+    {
+        static struct sink sink = {rtp_write, 0, 0, 0, 0, rtp_restart};
+        pthread_t thread;
+
+        if (rtp_start(opt.multicast, opt.bitrate + (*opt.recdevice ? 96000 : 0)))
+            return -1;
+        pthread_create(&thread, NULL, output_thread, &sink);
+        pthread_detach(thread);
+    }
+    if (*opt.record)
+    {
+        // New files start at keyframes
+        static struct sink sink = {record_write, record_packet, 0, 0, 0, record_restart};
+        pthread_t thread;
+
+        if (record_start(opt.record, (opt.record_minutes * 60 + RECORD_SEGMENT - 1) / RECORD_SEGMENT))
+            return -1;
+        pthread_create(&thread, NULL, output_thread, &sink);
+        pthread_detach(thread);
     }
     start_upnp_server(opt.local_port, "Screencast DLNA server");
     return 0;
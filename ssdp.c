@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -14,14 +15,32 @@
 #include <net/route.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "ssdp.h"
+#include "gena.h"
+#include "http.h"
+#include "hls.h"
+#include "rtp.h"
+#include "control.h"
 
 #define SSDP_PORT 1900
 #define SSDP_ADDR "239.255.255.250"
 #define NOTIFY_INTERVAL 30
 #define BUFFER_SIZE 4096
 #define CHUNK_SIZE 65536
+#define HTTP_IDLE_TIMEOUT 30
+
+#define MAX_INTERFACES 16
+#define MAX_MX 5
+#define MAX_PENDING_REPLIES 64
+#define MAX_SEARCH_SOURCES 64
+// Every source can send SEARCH_BURST searches at once, then one every SEARCH_REFILL seconds
+#define SEARCH_BURST 5
+#define SEARCH_REFILL 1.0
 
 // SSDP NOTIFY message template for MediaServer
 const char *notify_template =
@@ -29,10 +48,10 @@ const char *notify_template =
     "HOST: 239.255.255.250:1900\r\n"
     "CACHE-CONTROL: max-age=1800\r\n"
     "LOCATION: http://%s/description.xml\r\n"
-    "NT: urn:schemas-upnp-org:device:MediaServer:1\r\n"
+    "NT: %s\r\n"
     "NTS: ssdp:alive\r\n"
     "SERVER: %s/1.0\r\n"
-    "USN: uuid:%s::urn:schemas-upnp-org:device:MediaServer:1\r\n"
+    "USN: uuid:%s%s%s\r\n"
     "X-DLNADOC: DMS-1.50\r\n\r\n";
 
 // M-SEARCH response template for MediaServer
@@ -43,10 +62,52 @@ const char *search_response_template =
     "EXT:\r\n"
     "LOCATION: http://%s/description.xml\r\n"
     "SERVER: %s/1.0\r\n"
-    "ST: urn:schemas-upnp-org:device:MediaServer:1\r\n"
-    "USN: uuid:%s::urn:schemas-upnp-org:device:MediaServer:1\r\n"
+    "ST: %s\r\n"
+    "USN: uuid:%s%s%s\r\n"
     "X-DLNADOC: DMS-1.50\r\n\r\n";
 
+// Search targets we advertise, an empty string stands for uuid:<device uuid>
+const char *search_targets[] = {
+    "upnp:rootdevice",
+    "",
+    "urn:schemas-upnp-org:device:MediaServer:1",
+    "urn:schemas-upnp-org:service:ContentDirectory:1",
+    "urn:schemas-upnp-org:service:ConnectionManager:1",
+};
+#define NUM_SEARCH_TARGETS (sizeof(search_targets) / sizeof(search_targets[0]))
+
+// IPv4 interfaces on which the SSDP multicast group is joined
+struct interface
+{
+    int index;
+    char name[IF_NAMESIZE];
+    struct in_addr addr;
+};
+
+static struct interface interfaces[MAX_INTERFACES];
+static int num_interfaces;
+
+// M-SEARCH replies waiting for their random delay within MX, sent from the interface the search came in
+struct pending_reply
+{
+    struct sockaddr_in addr;
+    struct in_addr local;
+    int ifindex;
+    unsigned targets;
+    double due;
+};
+
+// Token bucket of a search source
+struct search_source
+{
+    struct in_addr addr;
+    double tokens, last;
+};
+
+static struct pending_reply pending_replies[MAX_PENDING_REPLIES];
+static int num_pending_replies;
+static struct search_source search_sources[MAX_SEARCH_SOURCES];
+
 // Device description XML template for MediaServer
 const char *device_description_template =
     "<?xml version=\"1.0\"?>\r\n"
@@ -104,10 +165,60 @@ const char *content_directory_template =
     "          <relatedStateVariable>A_ARG_TYPE_ObjectID</relatedStateVariable>\r\n"
     "        </argument>\r\n"
     "        <argument>\r\n"
+    "          <name>BrowseFlag</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_BrowseFlag</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>Filter</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Filter</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>StartingIndex</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Index</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>RequestedCount</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>SortCriteria</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_SortCriteria</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
     "          <name>Result</name>\r\n"
     "          <direction>out</direction>\r\n"
     "          <relatedStateVariable>A_ARG_TYPE_Result</relatedStateVariable>\r\n"
     "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>NumberReturned</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>TotalMatches</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Count</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>UpdateID</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_UpdateID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "      </argumentList>\r\n"
+    "    </action>\r\n"
+    "    <action>\r\n"
+    "      <name>GetSystemUpdateID</name>\r\n"
+    "      <argumentList>\r\n"
+    "        <argument>\r\n"
+    "          <name>Id</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>SystemUpdateID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
     "      </argumentList>\r\n"
     "    </action>\r\n"
     "  </actionList>\r\n"
@@ -121,9 +232,175 @@ const char *content_directory_template =
     "      <dataType>string</dataType>\r\n"
     "    </stateVariable>\r\n"
     "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_BrowseFlag</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "      <allowedValueList>\r\n"
+    "        <allowedValue>BrowseMetadata</allowedValue>\r\n"
+    "        <allowedValue>BrowseDirectChildren</allowedValue>\r\n"
+    "      </allowedValueList>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_Filter</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_SortCriteria</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_Index</name>\r\n"
+    "      <dataType>ui4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_Count</name>\r\n"
+    "      <dataType>ui4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_UpdateID</name>\r\n"
+    "      <dataType>ui4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
     "      <name>SortCapabilities</name>\r\n"
     "      <dataType>string</dataType>\r\n"
     "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"yes\">\r\n"
+    "      <name>SystemUpdateID</name>\r\n"
+    "      <dataType>ui4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "  </serviceStateTable>\r\n"
+    "</scpd>\r\n";
+
+const char *connection_manager_template =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">\r\n"
+    "  <specVersion>\r\n"
+    "    <major>1</major>\r\n"
+    "    <minor>0</minor>\r\n"
+    "  </specVersion>\r\n"
+    "  <actionList>\r\n"
+    "    <action>\r\n"
+    "      <name>GetProtocolInfo</name>\r\n"
+    "      <argumentList>\r\n"
+    "        <argument>\r\n"
+    "          <name>Source</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>SourceProtocolInfo</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>Sink</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>SinkProtocolInfo</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "      </argumentList>\r\n"
+    "    </action>\r\n"
+    "    <action>\r\n"
+    "      <name>GetCurrentConnectionIDs</name>\r\n"
+    "      <argumentList>\r\n"
+    "        <argument>\r\n"
+    "          <name>ConnectionIDs</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>CurrentConnectionIDs</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "      </argumentList>\r\n"
+    "    </action>\r\n"
+    "    <action>\r\n"
+    "      <name>GetCurrentConnectionInfo</name>\r\n"
+    "      <argumentList>\r\n"
+    "        <argument>\r\n"
+    "          <name>ConnectionID</name>\r\n"
+    "          <direction>in</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_ConnectionID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>RcsID</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_RcsID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>AVTransportID</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_AVTransportID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>ProtocolInfo</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_ProtocolInfo</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>PeerConnectionManager</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_ConnectionManager</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>PeerConnectionID</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_ConnectionID</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>Direction</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_Direction</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "        <argument>\r\n"
+    "          <name>Status</name>\r\n"
+    "          <direction>out</direction>\r\n"
+    "          <relatedStateVariable>A_ARG_TYPE_ConnectionStatus</relatedStateVariable>\r\n"
+    "        </argument>\r\n"
+    "      </argumentList>\r\n"
+    "    </action>\r\n"
+    "  </actionList>\r\n"
+    "  <serviceStateTable>\r\n"
+    "    <stateVariable sendEvents=\"yes\">\r\n"
+    "      <name>SourceProtocolInfo</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"yes\">\r\n"
+    "      <name>SinkProtocolInfo</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"yes\">\r\n"
+    "      <name>CurrentConnectionIDs</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_ConnectionStatus</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "      <allowedValueList>\r\n"
+    "        <allowedValue>OK</allowedValue>\r\n"
+    "        <allowedValue>ContentFormatMismatch</allowedValue>\r\n"
+    "        <allowedValue>InsufficientBandwidth</allowedValue>\r\n"
+    "        <allowedValue>UnreliableChannel</allowedValue>\r\n"
+    "        <allowedValue>Unknown</allowedValue>\r\n"
+    "      </allowedValueList>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_ConnectionManager</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_Direction</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "      <allowedValueList>\r\n"
+    "        <allowedValue>Input</allowedValue>\r\n"
+    "        <allowedValue>Output</allowedValue>\r\n"
+    "      </allowedValueList>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_ProtocolInfo</name>\r\n"
+    "      <dataType>string</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_ConnectionID</name>\r\n"
+    "      <dataType>i4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_AVTransportID</name>\r\n"
+    "      <dataType>i4</dataType>\r\n"
+    "    </stateVariable>\r\n"
+    "    <stateVariable sendEvents=\"no\">\r\n"
+    "      <name>A_ARG_TYPE_RcsID</name>\r\n"
+    "      <dataType>i4</dataType>\r\n"
+    "    </stateVariable>\r\n"
     "  </serviceStateTable>\r\n"
     "</scpd>\r\n";
 
@@ -136,14 +413,23 @@ const char *browse_response_template_start =
     "    xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"&gt;\n";
 const char *browse_response_template_end = "&lt;/DIDL-Lite&gt;";
 
-const char *browse_response_template_item =
-    "  &lt;item id=\"%d\" parentID=\"0\" restricted=\"1\"&gt;\n"
+const char *browse_response_template_container =
+    "  &lt;container id=\"0\" parentID=\"-1\" childCount=\"%d\" restricted=\"1\" searchable=\"0\"&gt;\n"
     "    &lt;dc:title&gt;%s&lt;/dc:title&gt;\n"
-    "    &lt;upnp:class&gt;object.item.videoItem&lt;/upnp:class&gt;\n"
+    "    &lt;upnp:class&gt;object.container.storageFolder&lt;/upnp:class&gt;\n"
+    "  &lt;/container&gt;\n";
+
+const char *browse_response_template_item_start =
+    "  &lt;item id=\"%s\" parentID=\"0\" restricted=\"1\"&gt;\n"
+    "    &lt;dc:title&gt;%s&lt;/dc:title&gt;\n"
+    "    &lt;upnp:class&gt;object.item.videoItem&lt;/upnp:class&gt;\n";
+const char *browse_response_template_item_end = "  &lt;/item&gt;\n";
+
+// One res element for every rendition, the client picks the one it likes
+const char *browse_response_template_res =
     "    &lt;res protocolInfo=\"http-get:*:video/MP2T:DLNA.ORG_PN=MPEG_TS_SD_EU_ISO;"
-    "DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=01700000000000000000000000000000\"&gt;"
-    "%s&lt;/res&gt;\n"
-    "  &lt;/item&gt;\n";
+    "DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=01700000000000000000000000000000\"%s&gt;"
+    "%s&lt;/res&gt;\n";
 
 // SOAP response template for Browse action
 const char *soap_response_template_start =
@@ -158,170 +444,566 @@ const char *soap_response_template_end =
     "</Result>\n "
     "      <NumberReturned>%d</NumberReturned>\n"
     "      <TotalMatches>%d</TotalMatches>\n"
-    "      <UpdateID>1</UpdateID>\n"
+    "      <UpdateID>%u</UpdateID>\n"
     "    </u:BrowseResponse>\n"
     "  </s:Body>\n"
     "</s:Envelope>";
 
+// SOAP response template for GetSystemUpdateID action
+const char *soap_update_id_template =
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"\n"
+    "    s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "  <s:Body>\n"
+    "    <u:GetSystemUpdateIDResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">\n"
+    "      <Id>%u</Id>\n"
+    "    </u:GetSystemUpdateIDResponse>\n"
+    "  </s:Body>\n"
+    "</s:Envelope>";
+
+// SOAP response templates for ConnectionManager actions
+const char *soap_protocol_info_template =
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"\n"
+    "    s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "  <s:Body>\n"
+    "    <u:GetProtocolInfoResponse xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">\n"
+    "      <Source>http-get:*:video/MP2T:*</Source>\n"
+    "      <Sink></Sink>\n"
+    "    </u:GetProtocolInfoResponse>\n"
+    "  </s:Body>\n"
+    "</s:Envelope>";
+
+const char *soap_connection_ids_template =
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"\n"
+    "    s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "  <s:Body>\n"
+    "    <u:GetCurrentConnectionIDsResponse xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">\n"
+    "      <ConnectionIDs>0</ConnectionIDs>\n"
+    "    </u:GetCurrentConnectionIDsResponse>\n"
+    "  </s:Body>\n"
+    "</s:Envelope>";
+
+// Without PrepareForConnection, connection 0 is the only one
+const char *soap_connection_info_template =
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"\n"
+    "    s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "  <s:Body>\n"
+    "    <u:GetCurrentConnectionInfoResponse xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">\n"
+    "      <RcsID>-1</RcsID>\n"
+    "      <AVTransportID>-1</AVTransportID>\n"
+    "      <ProtocolInfo>http-get:*:video/MP2T:*</ProtocolInfo>\n"
+    "      <PeerConnectionManager></PeerConnectionManager>\n"
+    "      <PeerConnectionID>-1</PeerConnectionID>\n"
+    "      <Direction>Output</Direction>\n"
+    "      <Status>OK</Status>\n"
+    "    </u:GetCurrentConnectionInfoResponse>\n"
+    "  </s:Body>\n"
+    "</s:Envelope>";
+
+// SOAP fault with a UPnP error code and description
+const char *soap_fault_template =
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"\n"
+    "    s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "  <s:Body>\n"
+    "    <s:Fault>\n"
+    "      <faultcode>s:Client</faultcode>\n"
+    "      <faultstring>UPnPError</faultstring>\n"
+    "      <detail>\n"
+    "        <UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">\n"
+    "          <errorCode>%d</errorCode>\n"
+    "          <errorDescription>%s</errorDescription>\n"
+    "        </UPnPError>\n"
+    "      </detail>\n"
+    "    </s:Fault>\n"
+    "  </s:Body>\n"
+    "</s:Envelope>";
+
+// Static documents are rendered once at startup together with their headers
+struct static_response
+{
+    const char *path;
+    char *headers, *not_modified;
+    char *body;
+    size_t len;
+    char etag[20];
+};
+
+#define MAX_STATIC_RESPONSES 3
+static struct static_response static_responses[MAX_STATIC_RESPONSES];
+
+static void add_static_response(const char *path, const char *body)
+{
+    struct static_response *r;
+    unsigned long long hash = 14695981039346656037ULL;
+    char headers[BUFFER_SIZE];
+    int i;
+
+    for (i = 0; i < MAX_STATIC_RESPONSES && static_responses[i].path; i++)
+        ;
+    if (i == MAX_STATIC_RESPONSES)
+        return;
+    r = &static_responses[i];
+    r->path = path;
+    r->body = strdup(body);
+    r->len = strlen(body);
+    // FNV-1a hash of the body as entity tag
+    for (size_t j = 0; j < r->len; j++)
+        hash = (hash ^ (unsigned char)body[j]) * 1099511628211ULL;
+    snprintf(r->etag, sizeof(r->etag), "\"%016llx\"", hash);
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 200 OK\r\n"
+             "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+             "Content-Length: %zu\r\n"
+             "ETag: %s\r\n",
+             r->len, r->etag);
+    r->headers = strdup(headers);
+    snprintf(headers, sizeof(headers),
+             "HTTP/1.1 304 Not Modified\r\n"
+             "ETag: %s\r\n",
+             r->etag);
+    r->not_modified = strdup(headers);
+}
+
+static void render_static_responses(const char *name, const char *uuid)
+{
+    char buffer[BUFFER_SIZE];
+
+    snprintf(buffer, sizeof(buffer), device_description_template, name, name, name, uuid);
+    add_static_response("/description.xml", buffer);
+    add_static_response("/ContentDirectory.xml", content_directory_template);
+    add_static_response("/ConnectionManager.xml", connection_manager_template);
+}
+
+static struct static_response *find_static_response(const char *path)
+{
+    for (int i = 0; i < MAX_STATIC_RESPONSES && static_responses[i].path; i++)
+        if (!strcmp(path, static_responses[i].path))
+            return &static_responses[i];
+    return 0;
+}
+
+// Send a pre-rendered document with one writev, or 304 if the client has it already
+static void send_static_response(int client_sock, const struct http_request *req, const struct static_response *r)
+{
+    static const char *keep_alive = "Connection: keep-alive\r\n\r\n", *close = "Connection: close\r\n\r\n";
+    char etags[300];
+    struct iovec iov[3];
+    int modified;
+
+    modified = http_get_header(req, "If-None-Match", etags, sizeof(etags)) ||
+               (!strstr(etags, r->etag) && strcmp(etags, "*"));
+    iov[0].iov_base = modified ? r->headers : r->not_modified;
+    iov[0].iov_len = strlen(iov[0].iov_base);
+    iov[1].iov_base = (void *)(req->keep_alive ? keep_alive : close);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = r->body;
+    iov[2].iov_len = r->len;
+    http_writev(client_sock, iov, modified && !req->head ? 3 : 2);
+}
+
+// Copy the content of the first <tag> element of the SOAP request to value
+static int get_soap_arg(const char *request, const char *tag, char *value, int size)
+{
+    char search_str[100];
+    const char *p, *q;
+
+    snprintf(search_str, sizeof(search_str), "<%s>", tag);
+    p = strstr(request, search_str);
+    if (!p)
+        return -1;
+    p += strlen(search_str);
+    q = strchr(p, '<');
+    if (!q || q - p >= size)
+        return -1;
+    memcpy(value, p, q - p);
+    value[q - p] = 0;
+    return 0;
+}
+
+static void send_xml_response(int client_sock, const struct http_request *req, const char *buffer)
+{
+    http_send_response(client_sock, req, 200, "text/xml; charset=\"utf-8\"", buffer, strlen(buffer), 0);
+}
+
+// The URL is in DIDL-Lite, which is itself escaped inside the SOAP body, so & is escaped twice
+static void escape_url(char *dst, const char *src)
+{
+    for (; *src; src++)
+        if (*src == '&')
+        {
+            strcpy(dst, "&amp;amp;");
+            dst += strlen(dst);
+        }
+        else
+            *dst++ = *src;
+    *dst = 0;
+}
+
+// Object IDs stay with their window while the list changes: the window ID of the stream path, with
+// the geometry for regions
+static void get_object_id(char *id, size_t size, const char *path)
+{
+    const char *query = strchr(path, '?');
+    unsigned long window = strtoul(path, 0, 16);
+    int x, y, w, h;
+
+    if (query && sscanf(query, "?x=%d&y=%d&w=%d&h=%d", &x, &y, &w, &h) == 4)
+        snprintf(id, size, "%lx:%dx%d+%d+%d", window, w, h, x, y);
+    else
+        snprintf(id, size, "%lx", window);
+}
+
 // Function to handle Browse action
-void handle_browse_request(int client_sock, const char *local_endpoint)
+void handle_browse_request(int client_sock, const struct http_request *req, const char *local_endpoint, const char *name)
 {
     char *buffer, *p, *q;
-    char **items = get_stream_items();
-    char url[300];
+    unsigned update_id;
+    char **items = get_stream_items(&update_id);
+    const char *request = req->body;
+    char url[1024], attrs[100], object_id[100], id[100], browse_flag[50], arg[20];
     int buflen = 2000;
-    int n = 0, rc;
+    int n = 0, total = 0, start = 0, count = 0, metadata, width, height, bitrate;
+
+    if (get_soap_arg(request, "ObjectID", object_id, sizeof(object_id)))
+        strcpy(object_id, "0");
+    if (get_soap_arg(request, "BrowseFlag", browse_flag, sizeof(browse_flag)))
+        strcpy(browse_flag, "BrowseDirectChildren");
+    if (!get_soap_arg(request, "StartingIndex", arg, sizeof(arg)))
+        start = atoi(arg);
+    if (!get_soap_arg(request, "RequestedCount", arg, sizeof(arg)))
+        count = atoi(arg);
+    metadata = !strcmp(browse_flag, "BrowseMetadata");
+
     for (int i = 0; items && items[i]; i++)
-        buflen += strlen(items[i]) + strlen(browse_response_template_item) + 100;
+    {
+        buflen += strlen(items[i]) + strlen(browse_response_template_item_start) + 100;
+        for (int j = 0; !get_rendition(j, &width, &height, &bitrate); j++)
+            buflen += strlen(items[i]) + strlen(browse_response_template_res) + 200;
+        total++;
+    }
+    buflen += strlen(name) + strlen(browse_response_template_container);
     buffer = (char *)malloc(buflen);
     strcpy(buffer, soap_response_template_start);
     strcat(buffer, browse_response_template_start);
     p = buffer + strlen(buffer);
-    for (int i = 0; items && items[i]; i++)
+    if (metadata && !strcmp(object_id, "0"))
     {
-        q = strchr(items[i], '\t');
-        if (!q)
-            continue;
-        *q++ = 0;
-        if (memcmp(q, "http://", 7) && memcmp(q, "rtsp://", 7))
+        sprintf(p, browse_response_template_container, total, name);
+        p += strlen(p);
+        n = total = 1;
+    }
+    else
+    {
+        // BrowseMetadata looks for the requested item among all of them
+        if (metadata)
         {
-            sprintf(url, "http://%s/stream/%s", local_endpoint, q);
-            q = url;
+            start = 0;
+            count = total;
         }
-        sprintf(p, browse_response_template_item, i + 1, items[i], q);
-        p += strlen(p);
-        free(items[i]);
-        n++;
+        else if (strcmp(object_id, "0"))
+            start = total;
+        if (start < 0)
+            start = total;
+        if (count <= 0 || count > total - start)
+            count = total - start;
+        for (int i = start; i < start + count; i++)
+        {
+            q = strchr(items[i], '\t');
+            if (!q)
+                continue;
+            *q++ = 0;
+            get_object_id(id, sizeof(id), q);
+            if (metadata && strcmp(id, object_id))
+                continue;
+            sprintf(p, browse_response_template_item_start, id, items[i]);
+            p += strlen(p);
+            if (memcmp(q, "http://", 7) && memcmp(q, "rtsp://", 7))
+            {
+                // The default rendition has no query, the others are selected by the query
+                for (int j = 0; !get_rendition(j, &width, &height, &bitrate); j++)
+                {
+                    sprintf(url, "http://%s/stream/", local_endpoint);
+                    escape_url(url + strlen(url), q);
+                    // Regions already use w and h for the size of the region
+                    if (j)
+                        sprintf(url + strlen(url), strchr(q, '?') ? "&amp;amp;ow=%d&amp;amp;oh=%d&amp;amp;br=%d"
+                                                                  : "?w=%d&amp;amp;h=%d&amp;amp;br=%d",
+                                width, height, bitrate);
+                    snprintf(attrs, sizeof(attrs), " resolution=\"%dx%d\" bitrate=\"%d\"", width, height,
+                             bitrate / 8);
+                    sprintf(p, browse_response_template_res, attrs, url);
+                    p += strlen(p);
+                }
+            }
+            else
+            {
+                sprintf(p, browse_response_template_res, "", q);
+                p += strlen(p);
+            }
+            strcpy(p, browse_response_template_item_end);
+            p += strlen(p);
+            n++;
+        }
+        if (metadata)
+            total = n;
+        else if (strcmp(object_id, "0"))
+            total = 0;
     }
+    for (int i = 0; items && items[i]; i++)
+        free(items[i]);
     if (items)
         free(items);
+    if (metadata && !n)
+    {
+        snprintf(buffer, buflen, soap_fault_template, 701, "No such object");
+        http_send_response(client_sock, req, 500, "text/xml; charset=\"utf-8\"", buffer, strlen(buffer), 0);
+        free(buffer);
+        return;
+    }
     strcpy(p, browse_response_template_end);
     p += strlen(p);
-    sprintf(p, soap_response_template_end, n, n);
+    sprintf(p, soap_response_template_end, n, total, update_id);
 
-    // Send HTTP headers
-    char headers[BUFFER_SIZE];
-    snprintf(headers, sizeof(headers),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: text/xml; charset=\"utf-8\"\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n\r\n",
-             strlen(buffer));
-
-    rc = write(client_sock, headers, strlen(headers));
-    rc = write(client_sock, buffer, strlen(buffer));
-    (void)rc;
+    send_xml_response(client_sock, req, buffer);
     free(buffer);
 }
 
-// Helper function to check if a buffer contains a specific SOAP action
-int contains_soap_action(const char *buffer, const char *action)
+void handle_get_system_update_id(int client_sock, const struct http_request *req)
 {
-    char search_str[256];
-    snprintf(search_str, sizeof(search_str),
-             "\"urn:schemas-upnp-org:service:ContentDirectory:1#%s\"", action);
-    return strstr(buffer, search_str) != NULL;
+    char buffer[BUFFER_SIZE];
+
+    snprintf(buffer, sizeof(buffer), soap_update_id_template, get_system_update_id());
+    send_xml_response(client_sock, req, buffer);
 }
 
-// Function to handle HTTP requests
-void handle_http_request(int client_sock, const char *local_endpoint, const char *name, const char *uuid)
+void handle_get_current_connection_info(int client_sock, const struct http_request *req)
 {
-    char buffer[BUFFER_SIZE];
-    char *p;
-    ssize_t n = read(client_sock, buffer, BUFFER_SIZE - 1);
-    buffer[n] = '\0';
-    int rc;
+    char buffer[BUFFER_SIZE], id[20];
+
+    if (!get_soap_arg(req->body, "ConnectionID", id, sizeof(id)) && !strcmp(id, "0"))
+        send_xml_response(client_sock, req, soap_connection_info_template);
+    else
+    {
+        snprintf(buffer, sizeof(buffer), soap_fault_template, 706, "Invalid connection reference");
+        http_send_response(client_sock, req, 500, "text/xml; charset=\"utf-8\"", buffer, strlen(buffer), 0);
+    }
+}
 
-    const char *response;
-    const char *content_type = "text/xml";
+// Helper function to check if the SOAPACTION header names a specific action
+int contains_soap_action(const struct http_request *req, const char *service, const char *action)
+{
+    char soap_action[256], search_str[256];
+    char *p = soap_action;
 
-    // Determine which resource is being requested
-    p = strchr(buffer, '\r');
-    n = p ? p - buffer : 50;
-    printf("Incoming HTTP request: %*.*s\n", (int)n, (int)n, buffer);
-    if (strstr(buffer, "GET /description.xml") != NULL)
+    if (http_get_header(req, "SOAPACTION", soap_action, sizeof(soap_action)))
+        return 0;
+    // The value is usually quoted
+    if (*p == '"' && p[strlen(p) - 1] == '"')
     {
-        snprintf(buffer, sizeof(buffer), device_description_template, name, name, name, uuid);
-        response = buffer;
+        p[strlen(p) - 1] = 0;
+        p++;
     }
-    else if (strstr(buffer, "GET /ContentDirectory.xml") != NULL)
+    snprintf(search_str, sizeof(search_str), "urn:schemas-upnp-org:service:%s:1#%s", service, action);
+    return !strcmp(p, search_str);
+}
+
+// Function to handle GENA SUBSCRIBE and UNSUBSCRIBE requests
+void handle_event_request(int client_sock, const struct http_request *req, int service, int subscribe)
+{
+    char callback[300], nt[50], sid[50], timeout[50], headers[BUFFER_SIZE];
+    int status, seconds = 0;
+    int has_sid = !http_get_header(req, "SID", sid, sizeof(sid));
+    int has_callback = !http_get_header(req, "CALLBACK", callback, sizeof(callback));
+    int has_nt = !http_get_header(req, "NT", nt, sizeof(nt));
+    const char *ptimeout = http_get_header(req, "TIMEOUT", timeout, sizeof(timeout)) ? 0 : timeout;
+
+    if (!subscribe)
+        status = has_sid && !has_callback && !has_nt ? gena_unsubscribe(sid) : 400;
+    else if (has_sid)
+        status = !has_callback && !has_nt ? gena_renew(sid, ptimeout, &seconds) : 400;
+    else if (has_callback && has_nt && !strcmp(nt, "upnp:event"))
+        status = gena_subscribe(service, callback, ptimeout, sid, &seconds);
+    else
+        status = 412;
+
+    *headers = 0;
+    if (status == 200 && subscribe)
     {
-        response = content_directory_template;
+        time_t now = time(NULL);
+        char date_str[64];
+        strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+        snprintf(headers, sizeof(headers),
+                 "DATE: %s\r\n"
+                 "SERVER: Linux UPnP/1.0 Screencast/1.0\r\n"
+                 "SID: %s\r\n"
+                 "TIMEOUT: Second-%d\r\n",
+                 date_str, sid, seconds);
     }
-    else if (strstr(buffer, "POST /ContentDirectory/control") != NULL)
+    http_send_response(client_sock, req, status, 0, 0, 0, headers);
+    // The initial event must follow the SUBSCRIBE response
+    if (status == 200 && subscribe && !has_sid)
+        gena_send_initial(sid);
+}
+
+// Function to handle HTTP requests, returns 0 if the connection can be kept open
+int handle_http_request(int client_sock, const struct http_request *req, const char *local_endpoint, const char *name)
+{
+    struct static_response *r;
+    int get = !strcmp(req->method, "GET") || req->head;
+    int post = !strcmp(req->method, "POST");
+
+    printf("Incoming HTTP request: %s %s\n", req->method, req->path);
+    if (get && (r = find_static_response(req->path)))
+        send_static_response(client_sock, req, r);
+    else if (post && !strcmp(req->path, "/ContentDirectory/control"))
     {
-        if (contains_soap_action(buffer, "Browse"))
+        if (contains_soap_action(req, "ContentDirectory", "Browse"))
         {
             // response = minidlnad;
-            handle_browse_request(client_sock, local_endpoint);
+            handle_browse_request(client_sock, req, local_endpoint, name);
         }
+        else if (contains_soap_action(req, "ContentDirectory", "GetSystemUpdateID"))
+            handle_get_system_update_id(client_sock, req);
         else
         {
             fprintf(stderr, "Unknown SOAP action\n");
             // Unknown SOAP action
-            const char *error = "HTTP/1.1 501 Not Implemented\r\n\r\n";
-            rc = write(client_sock, error, strlen(error));
+            http_send_response(client_sock, req, 501, 0, 0, 0, 0);
         }
-        close(client_sock);
-        return;
     }
-    else if ((p = strstr(buffer, "GET /stream/")) != NULL)
+    else if (post && !strcmp(req->path, "/ConnectionManager/control"))
     {
-        p += 12;
-        char *q = strchr(p, ' ');
-        if (q)
-            *q = 0;
-        serve(client_sock, p);
-        close(client_sock);
-        return;
+        if (contains_soap_action(req, "ConnectionManager", "GetProtocolInfo"))
+            send_xml_response(client_sock, req, soap_protocol_info_template);
+        else if (contains_soap_action(req, "ConnectionManager", "GetCurrentConnectionIDs"))
+            send_xml_response(client_sock, req, soap_connection_ids_template);
+        else if (contains_soap_action(req, "ConnectionManager", "GetCurrentConnectionInfo"))
+            handle_get_current_connection_info(client_sock, req);
+        else
+        {
+            fprintf(stderr, "Unknown SOAP action\n");
+            http_send_response(client_sock, req, 501, 0, 0, 0, 0);
+        }
+    }
+    else if ((!strcmp(req->method, "SUBSCRIBE") || !strcmp(req->method, "UNSUBSCRIBE")) &&
+             !strcmp(req->path, "/ContentDirectory/event"))
+        handle_event_request(client_sock, req, GENA_CONTENT_DIRECTORY, *req->method == 'S');
+    else if ((!strcmp(req->method, "SUBSCRIBE") || !strcmp(req->method, "UNSUBSCRIBE")) &&
+             !strcmp(req->path, "/ConnectionManager/event"))
+        handle_event_request(client_sock, req, GENA_CONNECTION_MANAGER, *req->method == 'S');
+    else if (get && !strncmp(req->path, "/stream/", 8))
+    {
+        if (req->head)
+            http_send_response(client_sock, req, 200, "video/MP2T", 0, HTTP_NO_LENGTH, 0);
+        else
+        {
+            // The stream ends with the connection
+            serve(client_sock, req->path + 8);
+            return -1;
+        }
+    }
+    else if (get && !strncmp(req->path, "/hls/", 5))
+        hls_handle_request(client_sock, req);
+    else if ((get || post) && !strcmp(req->path, "/control"))
+        control_handle_request(client_sock, req);
+    else if (get && !strcmp(req->path, "/multicast.sdp"))
+    {
+        char sdp[512], host[100], *p;
+        int len;
+
+        snprintf(host, sizeof(host), "%s", local_endpoint);
+        if ((p = strchr(host, ':')))
+            *p = 0;
+        len = rtp_sdp(sdp, sizeof(sdp), host);
+        if (len < 0)
+            http_send_response(client_sock, req, 404, 0, 0, 0, 0);
+        else
+            http_send_response(client_sock, req, 200, "application/sdp", sdp, len, 0);
     }
     else
     {
         // Send 404 for unknown resources
-        const char *not_found = "HTTP/1.1 404 Not Found\r\n\r\n";
-        rc = write(client_sock, not_found, strlen(not_found));
-        close(client_sock);
-        return;
+        http_send_response(client_sock, req, 404, 0, 0, 0, 0);
     }
-
-    // Send HTTP response headers
-    char headers[BUFFER_SIZE];
-    snprintf(headers, sizeof(headers),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n\r\n",
-             content_type, strlen(response));
-
-    rc = write(client_sock, headers, strlen(headers));
-    rc = write(client_sock, response, strlen(response));
-    (void)rc;
-    close(client_sock);
+    return req->keep_alive ? 0 : -1;
 }
 
 struct server_param
 {
     int server_sock;
-    const char *local_endpoint, *name, *uuid;
+    const char *name;
 };
 
+struct connection_param
+{
+    int client_sock;
+    struct server_param *server_param;
+};
+
+// Thread function to handle one HTTP connection, requests are answered in order
+void *http_connection_thread(void *arg)
+{
+    struct connection_param *param = (struct connection_param *)arg;
+    struct server_param *server_param = param->server_param;
+    struct http_conn conn;
+    struct http_request req;
+    struct timeval tv = {HTTP_IDLE_TIMEOUT, 0};
+    struct sockaddr_in local_addr;
+    socklen_t local_len = sizeof(local_addr);
+    char local_endpoint[30];
+    int status;
+
+    // URLs point to the address the client connected to, so they stay on its network
+    getsockname(param->client_sock, (struct sockaddr *)&local_addr, &local_len);
+    snprintf(local_endpoint, sizeof(local_endpoint), "%s:%d", inet_ntoa(local_addr.sin_addr), ntohs(local_addr.sin_port));
+    setsockopt(param->client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    http_conn_init(&conn, param->client_sock);
+    for (;;)
+    {
+        status = http_read_request(&conn, &req);
+        if (status > 0)
+            http_send_response(conn.sk, 0, status, 0, 0, 0, 0);
+        if (status || handle_http_request(conn.sk, &req, local_endpoint, server_param->name))
+            break;
+        http_request_free(&req);
+    }
+    http_request_free(&req);
+    http_conn_free(&conn);
+    close(param->client_sock);
+    free(param);
+    return NULL;
+}
+
 // Thread function to handle HTTP server
 void *http_server_thread(void *arg)
 {
-    const char *local_endpoint = ((struct server_param *)arg)->local_endpoint;
     int server_sock = ((struct server_param *)arg)->server_sock;
-    const char *name = ((struct server_param *)arg)->name;
-    const char *uuid = ((struct server_param *)arg)->uuid;
 
     for (;;)
     {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_len);
+        pthread_t thread;
 
         if (client_sock >= 0)
         {
-            handle_http_request(client_sock, local_endpoint, name, uuid);
+            struct connection_param *param = (struct connection_param *)malloc(sizeof(*param));
+
+            param->client_sock = client_sock;
+            param->server_param = (struct server_param *)arg;
+            if (pthread_create(&thread, NULL, http_connection_thread, param) != 0)
+            {
+                perror("pthread_create");
+                close(client_sock);
+                free(param);
+            }
+            else
+                pthread_detach(thread);
         }
         else
             sleep(1);
@@ -330,119 +1012,290 @@ void *http_server_thread(void *arg)
     return NULL;
 }
 
-// Function to handle M-SEARCH requests
-void handle_msearch(int sock, char *buffer, struct sockaddr_in *sender_addr, char *local_endpoint, const char *name, const char *uuid)
+static double now_seconds()
 {
-    if (strstr(buffer, "M-SEARCH") &&
-        (strstr(buffer, "ST: ssdp:all") || strstr(buffer, "ST: upnp:rootdevice") ||
-         strstr(buffer, "ST: urn:schemas-upnp-org:device:MediaServer")))
-    {
+    struct timespec ts;
 
-        // Get current time for DATE header
-        time_t now = time(NULL);
-        char date_str[64];
-        strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-        // Format response
-        char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), search_response_template, date_str, local_endpoint, name, uuid);
+// Returns 0 if the source may be answered, the least recently used slot is recycled
+static int rate_limit(struct in_addr addr, double now)
+{
+    struct search_source *src = &search_sources[0];
 
-        // Send response back to sender
-        printf("send m-search reply to %s\n", inet_ntoa(sender_addr->sin_addr));
-        sendto(sock, response, strlen(response), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+    for (int i = 0; i < MAX_SEARCH_SOURCES; i++)
+    {
+        if (search_sources[i].addr.s_addr == addr.s_addr)
+        {
+            src = &search_sources[i];
+            break;
+        }
+        if (search_sources[i].last < src->last)
+            src = &search_sources[i];
+    }
+    if (src->addr.s_addr != addr.s_addr)
+    {
+        src->addr = addr;
+        src->tokens = SEARCH_BURST;
+    }
+    else
+    {
+        src->tokens += (now - src->last) / SEARCH_REFILL;
+        if (src->tokens > SEARCH_BURST)
+            src->tokens = SEARCH_BURST;
     }
+    src->last = now;
+    if (src->tokens < 1)
+        return -1;
+    src->tokens--;
+    return 0;
 }
 
-char *get_default_interface()
+// Return the bit mask of search targets matching ST
+static unsigned match_search_target(const char *st, const char *uuid)
 {
-    FILE *fp;
-    char line[256], *iface = NULL;
-    char iface_name[64], dest[64], gateway[64];
+    if (!strcmp(st, "ssdp:all"))
+        return (1 << NUM_SEARCH_TARGETS) - 1;
+    if (!strncmp(st, "uuid:", 5))
+        return strcmp(st + 5, uuid) ? 0 : 1 << 1;
+    for (int i = 0; i < NUM_SEARCH_TARGETS; i++)
+        if (*search_targets[i] && !strcmp(st, search_targets[i]))
+            return 1 << i;
+    return 0;
+}
 
-    fp = fopen("/proc/net/route", "r");
-    if (fp == NULL)
-    {
-        perror("Failed to open /proc/net/route");
-        return NULL;
-    }
+// Function to handle M-SEARCH requests, replies are scheduled at a random time within MX
+void handle_msearch(char *buffer, struct sockaddr_in *sender_addr, const struct in_pktinfo *pktinfo, const char *uuid)
+{
+    struct http_request req;
+    char man[30], st[200], mx[10];
+    unsigned targets;
+    double now = now_seconds(), delay;
+    int i;
+
+    if (strncmp(buffer, "M-SEARCH * HTTP/1.1\r\n", 21))
+        return;
+    memset(&req, 0, sizeof(req));
+    req.headers = strstr(buffer, "\r\n");
+    if (http_get_header(&req, "MAN", man, sizeof(man)) || strcmp(man, "\"ssdp:discover\"") ||
+        http_get_header(&req, "ST", st, sizeof(st)))
+        return;
+    targets = match_search_target(st, uuid);
+    if (!targets)
+        return;
+    delay = http_get_header(&req, "MX", mx, sizeof(mx)) ? 1 : atoi(mx);
+    if (delay < 1)
+        delay = 1;
+    if (delay > MAX_MX)
+        delay = MAX_MX;
+
+    // Repeated searches from the same sender are merged into its pending reply
+    for (i = 0; i < num_pending_replies; i++)
+        if (pending_replies[i].addr.sin_addr.s_addr == sender_addr->sin_addr.s_addr &&
+            pending_replies[i].addr.sin_port == sender_addr->sin_port)
+        {
+            pending_replies[i].targets |= targets;
+            return;
+        }
+    if (num_pending_replies == MAX_PENDING_REPLIES || rate_limit(sender_addr->sin_addr, now))
+        return;
+    pending_replies[num_pending_replies].addr = *sender_addr;
+    pending_replies[num_pending_replies].ifindex = pktinfo->ipi_ifindex;
+    pending_replies[num_pending_replies].local = pktinfo->ipi_spec_dst;
+    for (i = 0; i < num_interfaces; i++)
+        if (interfaces[i].index == pktinfo->ipi_ifindex)
+            pending_replies[num_pending_replies].local = interfaces[i].addr;
+    pending_replies[num_pending_replies].targets = targets;
+    pending_replies[num_pending_replies].due = now + delay * rand() / (RAND_MAX + 1.0);
+    num_pending_replies++;
+}
 
-    // Skip the header line
-    if (fgets(line, sizeof(line), fp))
+// Send the replies which are due, returns the time to wait for the next one
+double send_pending_replies(int sock, int local_port, const char *name, const char *uuid)
+{
+    double now = now_seconds(), wait = NOTIFY_INTERVAL;
+    char date_str[64], response[BUFFER_SIZE], local_endpoint[30];
+    time_t t = time(NULL);
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+    for (int i = 0; i < num_pending_replies;)
     {
-        while (fgets(line, sizeof(line), fp))
+        struct pending_reply *reply = &pending_replies[i];
+
+        if (reply->due > now)
         {
-            sscanf(line, "%s %s %s", iface_name, dest, gateway);
+            if (reply->due - now < wait)
+                wait = reply->due - now;
+            i++;
+            continue;
+        }
+        snprintf(local_endpoint, sizeof(local_endpoint), "%s:%d", inet_ntoa(reply->local), local_port);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &reply->addr;
+        msg.msg_namelen = sizeof(reply->addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+        memset(CMSG_DATA(cmsg), 0, sizeof(struct in_pktinfo));
+        ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex = reply->ifindex;
+        ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_spec_dst = reply->local;
+        for (int j = 0; j < NUM_SEARCH_TARGETS; j++)
+        {
+            char st[100];
 
-            // Default route has destination 00000000
-            if (strcmp(dest, "00000000") == 0)
-            {
-                iface = strdup(iface_name);
-                break;
-            }
+            if (!(reply->targets & (1 << j)))
+                continue;
+            if (*search_targets[j])
+                strcpy(st, search_targets[j]);
+            else
+                snprintf(st, sizeof(st), "uuid:%s", uuid);
+            snprintf(response, sizeof(response), search_response_template, date_str, local_endpoint, name, st, uuid,
+                     *search_targets[j] ? "::" : "", search_targets[j]);
+            iov.iov_base = response;
+            iov.iov_len = strlen(response);
+            sendmsg(sock, &msg, 0);
         }
+        *reply = pending_replies[--num_pending_replies];
     }
-
-    fclose(fp);
-    return iface;
+    return wait;
 }
 
-int getlocalipaddr(char *ipaddr)
+// Send a NOTIFY for every search target on one interface
+void send_notify(int sock, struct sockaddr_in *dest_addr, const struct interface *iface, int local_port, const char *name, const char *uuid)
 {
-    struct ifaddrs *ifaddr, *ifa;
-    int family, s;
-    char host[NI_MAXHOST];
-    char *default_iface;
+    char message[BUFFER_SIZE], local_endpoint[30];
+    struct ip_mreqn mreqn;
 
-    // Get the default interface name
-    default_iface = get_default_interface();
-    if (default_iface == NULL)
+    memset(&mreqn, 0, sizeof(mreqn));
+    mreqn.imr_address = iface->addr;
+    mreqn.imr_ifindex = iface->index;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn));
+    snprintf(local_endpoint, sizeof(local_endpoint), "%s:%d", inet_ntoa(iface->addr), local_port);
+    for (int i = 0; i < NUM_SEARCH_TARGETS; i++)
     {
-        fprintf(stderr, "Could not determine default interface\n");
-        return -1;
+        char nt[100];
+
+        if (*search_targets[i])
+            strcpy(nt, search_targets[i]);
+        else
+            snprintf(nt, sizeof(nt), "uuid:%s", uuid);
+        snprintf(message, sizeof(message), notify_template, local_endpoint, nt, name, uuid,
+                 *search_targets[i] ? "::" : "", search_targets[i]);
+        sendto(sock, message, strlen(message), 0, (struct sockaddr *)dest_addr, sizeof(*dest_addr));
     }
+}
+
+void upnp_content_changed()
+{
+    gena_wakeup();
+}
+
+static void set_membership(int sock, const struct interface *iface, int option)
+{
+    struct ip_mreqn mreqn;
+
+    memset(&mreqn, 0, sizeof(mreqn));
+    inet_pton(AF_INET, SSDP_ADDR, &mreqn.imr_multiaddr);
+    mreqn.imr_address = iface->addr;
+    mreqn.imr_ifindex = iface->index;
+    setsockopt(sock, IPPROTO_IP, option, &mreqn, sizeof(mreqn));
+}
+
+// Enumerate the IPv4 multicast capable interfaces and join or leave the SSDP group
+// on the ones which appeared or went away, returns the number of new interfaces
+int update_interfaces(int sock)
+{
+    struct interface list[MAX_INTERFACES];
+    struct ifaddrs *ifaddr, *ifa;
+    int n = 0, added = 0;
 
     if (getifaddrs(&ifaddr) == -1)
     {
         perror("getifaddrs");
-        free(default_iface);
-        return -1;
+        return 0;
     }
-
-    // Find the IP address for the default interface
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+    for (ifa = ifaddr; ifa && n < MAX_INTERFACES; ifa = ifa->ifa_next)
     {
-        if (ifa->ifa_addr == NULL)
+        int index, i;
+
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET || (ifa->ifa_flags & IFF_LOOPBACK) ||
+            !(ifa->ifa_flags & IFF_UP) || !(ifa->ifa_flags & IFF_MULTICAST))
+            continue;
+        index = if_nametoindex(ifa->ifa_name);
+        // Only the first address of every interface is used
+        for (i = 0; i < n && list[i].index != index; i++)
+            ;
+        if (!index || i < n)
             continue;
+        list[n].index = index;
+        snprintf(list[n].name, sizeof(list[n].name), "%s", ifa->ifa_name);
+        list[n].addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+        n++;
+    }
+    freeifaddrs(ifaddr);
 
-        family = ifa->ifa_addr->sa_family;
+    for (int i = 0; i < num_interfaces; i++)
+    {
+        int j;
 
-        if (family == AF_INET && strcmp(ifa->ifa_name, default_iface) == 0)
+        for (j = 0; j < n && (list[j].index != interfaces[i].index || list[j].addr.s_addr != interfaces[i].addr.s_addr); j++)
+            ;
+        if (j == n)
         {
-            s = getnameinfo(ifa->ifa_addr,
-                            sizeof(struct sockaddr_in),
-                            host,
-                            NI_MAXHOST,
-                            NULL,
-                            0,
-                            NI_NUMERICHOST);
-            if (s != 0)
-            {
-                fprintf(stderr, "getnameinfo() failed: %s\n", gai_strerror(s));
-            }
-            else
-            {
-                strcpy(ipaddr, host);
-                freeifaddrs(ifaddr);
-                free(default_iface);
-                return 0;
-            }
-            break;
+            printf("Interface %s %s removed\n", interfaces[i].name, inet_ntoa(interfaces[i].addr));
+            set_membership(sock, &interfaces[i], IP_DROP_MEMBERSHIP);
         }
     }
+    for (int i = 0; i < n; i++)
+    {
+        int j;
 
-    freeifaddrs(ifaddr);
-    free(default_iface);
-    return -1;
+        for (j = 0; j < num_interfaces && (interfaces[j].index != list[i].index || interfaces[j].addr.s_addr != list[i].addr.s_addr); j++)
+            ;
+        if (j == num_interfaces)
+        {
+            printf("Starting UPnP service on %s %s\n", list[i].name, inet_ntoa(list[i].addr));
+            set_membership(sock, &list[i], IP_ADD_MEMBERSHIP);
+            added++;
+        }
+    }
+    memcpy(interfaces, list, sizeof(list[0]) * n);
+    num_interfaces = n;
+    return added;
+}
+
+// Netlink socket reporting address and link changes
+int open_netlink()
+{
+    struct sockaddr_nl addr;
+    int sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+
+    if (sk < 0)
+    {
+        perror("netlink socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind(sk, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("netlink bind");
+        close(sk);
+        return -1;
+    }
+    return sk;
 }
 
 void generate_uuid(char *uuid) {
@@ -475,18 +1328,12 @@ int start_upnp_server(int local_port, const char *name)
 {
     int sock;
     struct sockaddr_in bind_addr, dest_addr;
-    char message[BUFFER_SIZE];
     char buffer[BUFFER_SIZE];
-    char local_endpoint[30];
     char uuid[50];
+    int nlsock;
 
-    if (getlocalipaddr(local_endpoint))
-    {
-        fprintf(stderr, "Cannot get local IP address");
-        return -1;
-    }
     generate_uuid(uuid);
-    sprintf(local_endpoint + strlen(local_endpoint), ":%d", local_port);
+    render_static_responses(name, uuid);
     signal(SIGPIPE, SIG_IGN);
     // Create UDP socket for SSDP
     sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -496,9 +1343,10 @@ int start_upnp_server(int local_port, const char *name)
         return -1;
     }
 
-    // Enable address reuse
+    // Enable address reuse and get the interface of incoming packets
     int reuse = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &reuse, sizeof(reuse));
 
     // Bind to SSDP port
     memset(&bind_addr, 0, sizeof(bind_addr));
@@ -513,11 +1361,9 @@ int start_upnp_server(int local_port, const char *name)
         return -1;
     }
 
-    // Join multicast group
-    struct ip_mreq mreq;
-    inet_pton(AF_INET, SSDP_ADDR, &mreq.imr_multiaddr);
-    mreq.imr_interface.s_addr = INADDR_ANY;
-    setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    // Join multicast group on every interface and follow interface changes
+    nlsock = open_netlink();
+    update_interfaces(sock);
 
     // Set up multicast destination address
     memset(&dest_addr, 0, sizeof(dest_addr));
@@ -551,7 +1397,7 @@ int start_upnp_server(int local_port, const char *name)
 
     // Start HTTP server thread
     pthread_t http_thread;
-    struct server_param server_param = (struct server_param){server_sock, local_endpoint, name, uuid};
+    struct server_param server_param = (struct server_param){server_sock, name};
     if (pthread_create(&http_thread, NULL, http_server_thread, &server_param) != 0)
     {
         perror("pthread_create");
@@ -560,42 +1406,77 @@ int start_upnp_server(int local_port, const char *name)
         return -1;
     }
     pthread_detach(http_thread);
-
-    printf("Starting UPnP service on %s\n", local_endpoint);
+    if (gena_start())
+    {
+        close(sock);
+        close(server_sock);
+        return -1;
+    }
 
     // Main loop for SSDP communication
+    double next_notify = now_seconds();
     for (;;)
     {
-        // Wait for M-SEARCH requests (with timeout)
+        // Wait for M-SEARCH requests until the next reply or advertisement is due
         fd_set readfds;
         struct timeval tv;
+        double wait = send_pending_replies(sock, local_port, name, uuid), now = now_seconds();
+
+        if (now >= next_notify)
+        {
+            // Send periodic advertisement
+            for (int i = 0; i < num_interfaces; i++)
+                send_notify(sock, &dest_addr, &interfaces[i], local_port, name, uuid);
+            next_notify = now + NOTIFY_INTERVAL;
+        }
+        if (next_notify - now < wait)
+            wait = next_notify - now;
         FD_ZERO(&readfds);
         FD_SET(sock, &readfds);
-        tv.tv_sec = NOTIFY_INTERVAL;
-        tv.tv_usec = 0;
+        if (nlsock >= 0)
+            FD_SET(nlsock, &readfds);
+        tv.tv_sec = (int)wait;
+        tv.tv_usec = (int)((wait - tv.tv_sec) * 1e6);
 
-        if (select(sock + 1, &readfds, NULL, NULL, &tv) > 0)
+        if (select((sock > nlsock ? sock : nlsock) + 1, &readfds, NULL, NULL, &tv) <= 0)
+            continue;
+        if (nlsock >= 0 && FD_ISSET(nlsock, &readfds))
+        {
+            // The content of the netlink messages is not needed, just enumerate the interfaces again
+            if (recv(nlsock, buffer, sizeof(buffer), 0) > 0 && update_interfaces(sock))
+                next_notify = now;
+        }
+        if (FD_ISSET(sock, &readfds))
         {
             struct sockaddr_in sender_addr;
-            socklen_t sender_len = sizeof(sender_addr);
-            ssize_t n = recvfrom(sock, buffer, sizeof(buffer) - 1, 0,
-                                 (struct sockaddr *)&sender_addr, &sender_len);
+            struct in_pktinfo pktinfo;
+            char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+            struct iovec iov = {buffer, sizeof(buffer) - 1};
+            struct msghdr msg;
+            struct cmsghdr *cmsg;
+
+            memset(&msg, 0, sizeof(msg));
+            memset(&pktinfo, 0, sizeof(pktinfo));
+            msg.msg_name = &sender_addr;
+            msg.msg_namelen = sizeof(sender_addr);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t n = recvmsg(sock, &msg, 0);
 
+            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+                    memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
             if (n > 0)
             {
                 buffer[n] = '\0';
-                handle_msearch(sock, buffer, &sender_addr, local_endpoint, name, uuid);
+                handle_msearch(buffer, &sender_addr, &pktinfo, uuid);
             }
         }
-        else
-        {
-            // Send periodic advertisement
-            snprintf(message, sizeof(message), notify_template, local_endpoint, name, uuid);
-            sendto(sock, message, strlen(message), 0,
-                   (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-        }
     }
 
+    close(nlsock);
     close(sock);
     close(server_sock);
     return 0;
@@ -7,7 +7,10 @@ extern "C"
 #endif
 
     int start_upnp_server(int local_port, const char *name);
-    char **get_stream_items();
+    void upnp_content_changed();
+    char **get_stream_items(unsigned *update_id);
+    unsigned get_system_update_id();
+    int get_rendition(int i, int *width, int *height, int *bitrate);
     int serve(int sk, const char *name);
 
 #ifdef __cplusplus
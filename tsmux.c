@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "tsmux.h"
+
+#define PMT_PID 0x1000
+#define VIDEO_PID 0x100
+#define AUDIO_PID 0x101
+#define STREAM_TYPE_H264 0x1b
+#define STREAM_TYPE_AAC 0x0f
+#define TS_PAYLOAD (TSMUX_PACKET_SIZE - 4)
+// PES header with PTS and DTS
+#define MAX_PES_HEADER 19
+// Time after which the PCR and the tables are sent again, in 90 kHz units. They are only checked
+// when something is written, at least every captured frame, so these are well below the 100 ms
+// allowed between two PCRs and usual between two tables
+#define PCR_PERIOD 1800
+#define PSI_PERIOD 6000
+// ADTS sampling frequency index of 48 kHz and AAC LC profile
+#define ADTS_48000 3
+#define ADTS_LC 1
+
+// Muxer state of one output, only used by the encoder thread
+struct tsmux
+{
+    int (*write)(void *opaque, uint8_t *buf, int buf_size);
+    void *opaque;
+    // Added to the time stamps, so that the decoder gets this much time after the PCR
+    int delay;
+    // PAT and PMT are built once, only the continuity counters are filled in
+    uint8_t tables[2 * TSMUX_PACKET_SIZE];
+    unsigned pat_cc, pmt_cc, video_cc, audio_cc;
+    // Time of the last PCR and of the last tables, in the time of the PCR
+    int64_t pcr_time, psi_time;
+    // Output of one PES packet, kept for the next one
+    uint8_t *buf;
+    int size;
+};
+
+// Parts of a PES packet, copied into the TS packets in order
+struct piece
+{
+    const uint8_t *data;
+    int size;
+};
+
+// CRC of the sections, MPEG-2 uses the CRC-32 polynomial without reflection
+static uint32_t crc32_mpeg(const uint8_t *data, int size)
+{
+    uint32_t crc = 0xffffffff;
+
+    for (int i = 0; i < size; i++)
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int b = 0; b < 8; b++)
+            crc = crc & 0x80000000 ? crc << 1 ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+// One TS packet with a section starting right after the pointer field, stuffed with 0xff
+static void put_section(uint8_t *p, int pid, const uint8_t *section, int size)
+{
+    uint32_t crc = crc32_mpeg(section, size);
+
+    memset(p, 0xff, TSMUX_PACKET_SIZE);
+    p[0] = 0x47;
+    p[1] = 0x40 | pid >> 8;
+    p[2] = pid & 0xff;
+    p[3] = 0x10;
+    p[4] = 0;
+    memcpy(p + 5, section, size);
+    p[5 + size] = crc >> 24;
+    p[6 + size] = crc >> 16;
+    p[7 + size] = crc >> 8;
+    p[8 + size] = crc;
+}
+
+struct tsmux *tsmux_open(int (*write)(void *opaque, uint8_t *buf, int buf_size), void *opaque, int audio, int delay)
+{
+    struct tsmux *m = (struct tsmux *)calloc(1, sizeof(*m));
+    // Program 1 in transport stream 1
+    uint8_t pat[] = {0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0, 0, 0x00, 0x01, 0xe0 | PMT_PID >> 8, PMT_PID & 0xff};
+    // The PCR is carried by the video stream
+    uint8_t pmt[] = {0x02, 0xb0, 0, 0x00, 0x01, 0xc1, 0, 0, 0xe0 | VIDEO_PID >> 8, VIDEO_PID & 0xff, 0xf0, 0,
+                     STREAM_TYPE_H264, 0xe0 | VIDEO_PID >> 8, VIDEO_PID & 0xff, 0xf0, 0,
+                     STREAM_TYPE_AAC, 0xe0 | AUDIO_PID >> 8, AUDIO_PID & 0xff, 0xf0, 0};
+    int pmt_size = audio ? sizeof(pmt) : sizeof(pmt) - 5;
+
+    if (!m)
+        return 0;
+    m->write = write;
+    m->opaque = opaque;
+    m->delay = delay;
+    m->pcr_time = m->psi_time = INT64_MIN / 2;
+    // Section lengths count the bytes after the length field, with the CRC
+    pmt[2] = pmt_size - 3 + 4;
+    put_section(m->tables, 0, pat, sizeof(pat));
+    put_section(m->tables + TSMUX_PACKET_SIZE, PMT_PID, pmt, pmt_size);
+    return m;
+}
+
+// 33 bit base in 90 kHz units, 6 reserved bits and a zero extension
+static void put_pcr_field(uint8_t *p, int64_t pcr)
+{
+    p[0] = pcr >> 25;
+    p[1] = pcr >> 17;
+    p[2] = pcr >> 9;
+    p[3] = pcr >> 1;
+    p[4] = (pcr & 1) << 7 | 0x7e;
+    p[5] = 0;
+}
+
+static void put_timestamp(uint8_t *p, int marker, int64_t ts)
+{
+    ts &= 0x1ffffffffLL;
+    p[0] = marker << 4 | (ts >> 29 & 0x0e) | 1;
+    p[1] = ts >> 22;
+    p[2] = (ts >> 14 & 0xfe) | 1;
+    p[3] = ts >> 7;
+    p[4] = (ts << 1 & 0xfe) | 1;
+}
+
+// Returns the size of the PES header, size is the payload size or 0 for unbounded video packets
+static int put_pes_header(uint8_t *h, int stream_id, int size, int64_t pts, int64_t dts)
+{
+    int n = dts != pts ? 10 : 5, length = size ? size + 3 + n : 0;
+
+    h[0] = 0;
+    h[1] = 0;
+    h[2] = 1;
+    h[3] = stream_id;
+    h[4] = length > 0xffff ? 0 : length >> 8;
+    h[5] = length > 0xffff ? 0 : length & 0xff;
+    h[6] = 0x80;
+    h[7] = dts != pts ? 0xc0 : 0x80;
+    h[8] = n;
+    put_timestamp(h + 9, dts != pts ? 3 : 2, pts);
+    if (dts != pts)
+        put_timestamp(h + 14, 1, dts);
+    return 9 + n;
+}
+
+// Make room for packets more TS packets after len bytes of output
+static int reserve(struct tsmux *m, int len, int packets)
+{
+    int size = len + packets * TSMUX_PACKET_SIZE;
+
+    if (size > m->size)
+    {
+        uint8_t *buf = (uint8_t *)realloc(m->buf, size);
+
+        if (!buf)
+            return -1;
+        m->buf = buf;
+        m->size = size;
+    }
+    return 0;
+}
+
+// Split the pieces of a PES packet into TS packets after len bytes of output. The first one
+// gets the PCR if pcr is not negative and the random access flag for keyframes, the last one
+// is filled up with adaptation field stuffing. Returns the new output length
+static int put_pes(struct tsmux *m, int len, int pid, unsigned *cc, struct piece *pieces, int64_t pcr, int key)
+{
+    int left = 0, first = 1;
+
+    for (struct piece *pc = pieces; pc->data; pc++)
+        left += pc->size;
+    // The first packet loses at most 8 bytes to the adaptation field
+    if (reserve(m, len, (left + TS_PAYLOAD - 1) / TS_PAYLOAD + 1))
+        return -1;
+    while (left > 0)
+    {
+        uint8_t *p = m->buf + len, *q = p + 4;
+        int af = first && (pcr >= 0 || key) ? (pcr >= 0 ? 8 : 2) : 0, payload;
+
+        if (left < TS_PAYLOAD - af)
+            af = TS_PAYLOAD - left;
+        payload = TS_PAYLOAD - af;
+        p[0] = 0x47;
+        p[1] = (first ? 0x40 : 0) | pid >> 8;
+        p[2] = pid & 0xff;
+        p[3] = (af ? 0x30 : 0x10) | (*cc)++ % 16;
+        if (af)
+        {
+            q[0] = af - 1;
+            if (af > 1)
+            {
+                int used = 2;
+
+                q[1] = (first && key ? 0x40 : 0) | (first && pcr >= 0 ? 0x10 : 0);
+                if (q[1] & 0x10)
+                {
+                    put_pcr_field(q + 2, pcr);
+                    used += 6;
+                }
+                memset(q + used, 0xff, af - used);
+            }
+            q += af;
+        }
+        while (payload > 0)
+        {
+            int n = pieces->size < payload ? pieces->size : payload;
+
+            memcpy(q, pieces->data, n);
+            q += n;
+            pieces->data += n;
+            pieces->size -= n;
+            payload -= n;
+            left -= n;
+            if (!pieces->size)
+                pieces++;
+        }
+        len += TSMUX_PACKET_SIZE;
+        first = 0;
+    }
+    return len;
+}
+
+// PAT and PMT after len bytes of output, returns the new output length
+static int put_tables(struct tsmux *m, int len, int64_t now)
+{
+    if (reserve(m, len, 2))
+        return -1;
+    memcpy(m->buf + len, m->tables, sizeof(m->tables));
+    m->buf[len + 3] = 0x10 | m->pat_cc++ % 16;
+    m->buf[len + TSMUX_PACKET_SIZE + 3] = 0x10 | m->pmt_cc++ % 16;
+    m->psi_time = now;
+    return len + sizeof(m->tables);
+}
+
+// The tables when they are due, and the PCR in a video packet without payload, which keeps the
+// continuity counter, when it is due and pcr is set
+static int put_periodic(struct tsmux *m, int len, int64_t now, int pcr)
+{
+    uint8_t *p;
+
+    if (now - m->psi_time >= PSI_PERIOD)
+        len = put_tables(m, len, now);
+    if (len < 0 || !pcr || now - m->pcr_time < PCR_PERIOD)
+        return len;
+    if (reserve(m, len, 1))
+        return -1;
+    p = m->buf + len;
+    p[0] = 0x47;
+    p[1] = VIDEO_PID >> 8;
+    p[2] = VIDEO_PID & 0xff;
+    p[3] = 0x20 | (m->video_cc - 1) % 16;
+    p[4] = TSMUX_PACKET_SIZE - 5;
+    p[5] = 0x10;
+    put_pcr_field(p + 6, now);
+    memset(p + 12, 0xff, TSMUX_PACKET_SIZE - 12);
+    m->pcr_time = now;
+    return len + TSMUX_PACKET_SIZE;
+}
+
+int tsmux_write_video(struct tsmux *m, const uint8_t *data, int size, int64_t pts, int64_t dts, int key)
+{
+    // Access unit delimiter, for the decoders that need it
+    static const uint8_t aud[] = {0, 0, 0, 1, 9, 0xf0};
+    uint8_t header[MAX_PES_HEADER];
+    struct piece pieces[4] = {{header}};
+    int len, n = 1;
+    int64_t pcr = dts < 0 ? 0 : dts;
+
+    pieces[0].size = put_pes_header(header, 0xe0, 0, pts + m->delay, dts + m->delay);
+    if (size < 5 || (memcmp(data, aud, 5) && memcmp(data, aud + 1, 4)))
+        pieces[n++] = (struct piece){aud, sizeof(aud)};
+    pieces[n] = (struct piece){data, size};
+    // Clients can start at every keyframe
+    len = key ? put_tables(m, 0, pcr) : put_periodic(m, 0, pcr, 0);
+    // The PCR never goes back, audio may have sent a later one
+    if (pcr < m->pcr_time)
+        pcr = -1;
+    else
+        m->pcr_time = pcr;
+    if (len >= 0)
+        len = put_pes(m, len, VIDEO_PID, &m->video_cc, pieces, pcr, key);
+    if (len < 0 || m->write(m->opaque, m->buf, len) < 0)
+        return -1;
+    return 0;
+}
+
+int tsmux_write_audio(struct tsmux *m, const uint8_t *data, int size, int64_t pts)
+{
+    uint8_t header[MAX_PES_HEADER], adts[7];
+    struct piece pieces[4] = {{header}, {adts, sizeof(adts)}, {data, size}};
+    int len = size + sizeof(adts);
+
+    // ADTS header of a single raw AAC frame without CRC, stereo
+    adts[0] = 0xff;
+    adts[1] = 0xf1;
+    adts[2] = ADTS_LC << 6 | ADTS_48000 << 2;
+    adts[3] = 2 << 6 | len >> 11;
+    adts[4] = len >> 3;
+    adts[5] = (len & 7) << 5 | 0x1f;
+    adts[6] = 0xfc;
+    pieces[0].size = put_pes_header(header, 0xc0, len, pts + m->delay, pts + m->delay);
+    len = put_periodic(m, 0, pts, 1);
+    if (len >= 0)
+        len = put_pes(m, len, AUDIO_PID, &m->audio_cc, pieces, -1, 0);
+    if (len < 0 || m->write(m->opaque, m->buf, len) < 0)
+        return -1;
+    return 0;
+}
+
+// Keep the PCR and the tables going while nothing else is written, now is in 90 kHz units
+int tsmux_write_time(struct tsmux *m, int64_t now)
+{
+    int len = put_periodic(m, 0, now, 1);
+
+    if (len < 0 || (len && m->write(m->opaque, m->buf, len) < 0))
+        return -1;
+    return 0;
+}
+
+void tsmux_close(struct tsmux *m)
+{
+    free(m->buf);
+    free(m);
+}
@@ -0,0 +1,29 @@
+#ifndef _TSMUX_H_INCLUDED_
+#define _TSMUX_H_INCLUDED_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define TSMUX_PACKET_SIZE 188
+
+    struct tsmux;
+
+    // One H.264 stream and optionally one AAC stream (LC, 48 kHz, stereo), written through write
+    struct tsmux *tsmux_open(int (*write)(void *opaque, uint8_t *buf, int buf_size), void *opaque, int audio,
+                             int delay);
+    // Time stamps in 90 kHz units. Keyframes are preceded by PAT and PMT, and the tables and the
+    // PCR are repeated when audio or the time is written, so that they come at least every 100 ms
+    int tsmux_write_video(struct tsmux *m, const uint8_t *data, int size, int64_t pts, int64_t dts, int key);
+    int tsmux_write_audio(struct tsmux *m, const uint8_t *data, int size, int64_t pts);
+    int tsmux_write_time(struct tsmux *m, int64_t now);
+    void tsmux_close(struct tsmux *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
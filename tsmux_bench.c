@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libavformat/avformat.h>
+
+#include "tsmux.h"
+
+// Times muxing the same packets with tsmux and with the libavformat MPEG-TS muxer, both writing
+// to a callback that drops the output
+#define VIDEO_FRAMES 30000
+#define FRAME_TIME 3000
+#define AUDIO_FRAME_TIME 1920
+#define MAX_FRAME 100000
+#define DELAY 63000
+
+struct packet
+{
+    int video, size, key;
+    int64_t pts;
+};
+
+static struct packet *packets;
+static int npackets;
+static uint8_t data[MAX_FRAME];
+static int64_t written;
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int write_null(void *opaque, uint8_t *buf, int buf_size)
+{
+    written += buf_size;
+    return buf_size;
+}
+
+// 30 fps video of about 2 Mbit/s with a keyframe every 5 seconds and 48 kHz AAC audio
+static void make_packets()
+{
+    int64_t next_audio = 0;
+
+    packets = (struct packet *)malloc(sizeof(*packets) * VIDEO_FRAMES * 3);
+    srand(1);
+    for (int n = 0; n < VIDEO_FRAMES; n++)
+    {
+        int key = n % 150 == 0;
+
+        for (; next_audio <= (int64_t)n * FRAME_TIME; next_audio += AUDIO_FRAME_TIME)
+            packets[npackets++] = (struct packet){0, 300 + rand() % 200, 1, next_audio};
+        packets[npackets++] = (struct packet){1, key ? 60000 + rand() % 30000 : 2000 + rand() % 10000, key,
+                                              (int64_t)n * FRAME_TIME};
+    }
+    for (int i = 0; i < MAX_FRAME; i++)
+        data[i] = rand();
+    // Every frame starts with an access unit delimiter
+    memcpy(data, "\0\0\0\1\x09\xf0", 6);
+}
+
+static double bench_tsmux()
+{
+    struct tsmux *m = tsmux_open(write_null, 0, 1, DELAY);
+    double start = now_seconds();
+
+    for (int i = 0; i < npackets; i++)
+    {
+        struct packet *p = &packets[i];
+
+        if (p->video)
+            tsmux_write_video(m, data, p->size, p->pts, p->pts, p->key);
+        else
+            tsmux_write_audio(m, data, p->size, p->pts);
+    }
+    tsmux_close(m);
+    return now_seconds() - start;
+}
+
+static double bench_libavformat()
+{
+    AVFormatContext *oc = 0;
+    AVStream *video, *audio;
+    AVPacket *pkt = av_packet_alloc();
+    uint8_t *buf = (uint8_t *)av_malloc(4096);
+    double start;
+
+    avformat_alloc_output_context2(&oc, 0, "mpegts", 0);
+    video = avformat_new_stream(oc, 0);
+    video->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    video->codecpar->codec_id = AV_CODEC_ID_H264;
+    video->codecpar->width = 1920;
+    video->codecpar->height = 1080;
+    video->time_base = (AVRational){1, 90000};
+    audio = avformat_new_stream(oc, 0);
+    audio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+    audio->codecpar->codec_id = AV_CODEC_ID_AAC;
+    audio->codecpar->sample_rate = 48000;
+    audio->codecpar->channels = 2;
+    audio->codecpar->channel_layout = AV_CH_LAYOUT_STEREO;
+    // AudioSpecificConfig of AAC LC, 48 kHz, stereo, the muxer adds the ADTS headers with it
+    audio->codecpar->extradata = (uint8_t *)av_mallocz(2 + AV_INPUT_BUFFER_PADDING_SIZE);
+    audio->codecpar->extradata[0] = 0x11;
+    audio->codecpar->extradata[1] = 0x90;
+    audio->codecpar->extradata_size = 2;
+    audio->time_base = (AVRational){1, 90000};
+    oc->pb = avio_alloc_context(buf, 4096, 1, 0, 0, write_null, 0);
+    if (avformat_write_header(oc, 0) < 0)
+    {
+        fprintf(stderr, "avformat_write_header failed\n");
+        exit(1);
+    }
+    start = now_seconds();
+    for (int i = 0; i < npackets; i++)
+    {
+        struct packet *p = &packets[i];
+
+        pkt->data = data;
+        pkt->size = p->size;
+        pkt->pts = pkt->dts = p->pts;
+        pkt->stream_index = p->video ? video->index : audio->index;
+        pkt->flags = p->key ? AV_PKT_FLAG_KEY : 0;
+        av_interleaved_write_frame(oc, pkt);
+    }
+    av_write_trailer(oc);
+    start = now_seconds() - start;
+    av_freep(&oc->pb->buffer);
+    avio_context_free(&oc->pb);
+    avformat_free_context(oc);
+    av_packet_free(&pkt);
+    return start;
+}
+
+static void report(const char *name, double seconds)
+{
+    printf("%-12s %8.3f s %10.0f packets/s %8.1f MB/s out\n", name, seconds, npackets / seconds,
+           written / seconds / 1e6);
+    written = 0;
+}
+
+int main()
+{
+    make_packets();
+    report("tsmux", bench_tsmux());
+    report("libavformat", bench_libavformat());
+    return 0;
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+#include "tsmux.h"
+
+// Muxes synthetic H.264 and AAC packets with tsmux, checks the transport stream packets and
+// demuxes it with libavformat, whose packets have to match the ones muxed
+#define VIDEO_FRAMES 600
+#define FRAME_TIME 3000
+#define AUDIO_FRAME_TIME 1920
+#define DELAY 63000
+#define VIDEO_PID 0x100
+#define AUDIO_PID 0x101
+// Frames from this one on are static content without audio, encoded every 15th capture
+#define STATIC_FROM 300
+#define STATIC_EVERY 15
+
+struct packet
+{
+    uint8_t *data;
+    int size, key;
+    int64_t pts, dts;
+};
+
+static uint8_t *out;
+static size_t out_len, out_size, read_pos;
+static struct packet video[VIDEO_FRAMES], audio[STATIC_FROM * FRAME_TIME / AUDIO_FRAME_TIME + 1];
+static int nvideo, naudio, nkeys, errors;
+
+static unsigned random_state = 1;
+
+static unsigned next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return random_state >> 8;
+}
+
+static void fail(const char *message, int n)
+{
+    fprintf(stderr, "%s %d\n", message, n);
+    errors++;
+}
+
+static int write_out(void *opaque, uint8_t *buf, int buf_size)
+{
+    if (out_len + buf_size > out_size)
+    {
+        out_size = (out_len + buf_size) * 2;
+        out = (uint8_t *)realloc(out, out_size);
+    }
+    memcpy(out + out_len, buf, buf_size);
+    out_len += buf_size;
+    return buf_size;
+}
+
+static int read_out(void *opaque, uint8_t *buf, int buf_size)
+{
+    int n = out_len - read_pos < (size_t)buf_size ? (int)(out_len - read_pos) : buf_size;
+
+    if (!n)
+        return AVERROR_EOF;
+    memcpy(buf, out + read_pos, n);
+    read_pos += n;
+    return n;
+}
+
+// An access unit of NAL units with random payload, every other one starts with an access unit
+// delimiter, tsmux adds one to the others. The packet keeps what the demuxer has to return
+static void make_video(struct packet *p, int n, int key)
+{
+    static const uint8_t aud[] = {0, 0, 0, 1, 9, 0xf0};
+    int size = key ? 20000 + next_random() % 80000 : 10 + next_random() % 30000;
+
+    p->data = (uint8_t *)malloc(sizeof(aud) + size);
+    memcpy(p->data, aud, sizeof(aud));
+    p->data[6] = 0;
+    p->data[7] = 0;
+    p->data[8] = 1;
+    p->data[9] = key ? 0x65 : 0x41;
+    for (int i = 10; i < (int)sizeof(aud) + size; i++)
+        p->data[i] = next_random();
+    p->size = sizeof(aud) + size;
+    p->key = key;
+    p->dts = (int64_t)n * FRAME_TIME;
+    // Some frames are shown later than they are decoded
+    p->pts = p->dts + (n % 3 ? 0 : 2 * FRAME_TIME);
+}
+
+static void make_audio(struct packet *p, int n)
+{
+    p->size = 7 + 150 + next_random() % 400;
+    p->data = (uint8_t *)malloc(p->size);
+    for (int i = 7; i < p->size; i++)
+        p->data[i] = next_random();
+    p->pts = p->dts = (int64_t)n * AUDIO_FRAME_TIME;
+}
+
+static void mux()
+{
+    struct tsmux *m = tsmux_open(write_out, 0, 1, DELAY);
+    int64_t next_audio = 0;
+
+    for (int n = 0; n < VIDEO_FRAMES; n++)
+    {
+        int64_t time = (int64_t)n * FRAME_TIME;
+
+        while (n < STATIC_FROM && next_audio <= time)
+        {
+            struct packet *p = &audio[naudio];
+
+            make_audio(p, naudio++);
+            if (tsmux_write_audio(m, p->data + 7, p->size - 7, p->pts))
+                fail("tsmux_write_audio failed at", naudio);
+            next_audio += AUDIO_FRAME_TIME;
+        }
+        if (n < STATIC_FROM || n % STATIC_EVERY == 0)
+        {
+            struct packet *p = &video[nvideo++];
+            int skip;
+
+            make_video(p, n, n % 150 == 0);
+            nkeys += p->key;
+            // The delimiter of every other frame is left to tsmux
+            skip = nvideo % 2 ? 6 : 0;
+            if (tsmux_write_video(m, p->data + skip, p->size - skip, p->pts, p->dts, p->key))
+                fail("tsmux_write_video failed at", n);
+        }
+        else if (tsmux_write_time(m, time))
+            fail("tsmux_write_time failed at", n);
+    }
+    tsmux_close(m);
+}
+
+// Sync bytes, continuity counters, PCR and table intervals and the keyframes, which libavformat
+// only finds with its parser
+static void check_packets()
+{
+    unsigned cc[0x2000];
+    int64_t pcr, last_pcr = -1, last_pat = -1;
+    int max_pcr_gap = 0, max_pat_gap = 0, random_access = 0;
+
+    memset(cc, 0xff, sizeof(cc));
+    if (out_len % TSMUX_PACKET_SIZE)
+        fail("Output size is not a multiple of the packet size", (int)out_len);
+    for (size_t i = 0; i + TSMUX_PACKET_SIZE <= out_len; i += TSMUX_PACKET_SIZE)
+    {
+        const uint8_t *p = out + i;
+        int pid = (p[1] & 0x1f) << 8 | p[2], payload = p[3] & 0x10, counter = p[3] & 15;
+
+        if (p[0] != 0x47)
+            fail("Sync byte missing in packet", (int)(i / TSMUX_PACKET_SIZE));
+        if (cc[pid] != 0xffffffff && counter != (cc[pid] + (payload ? 1 : 0)) % 16)
+            fail("Continuity counter wrong in packet", (int)(i / TSMUX_PACKET_SIZE));
+        cc[pid] = counter;
+        if (pid == VIDEO_PID && p[1] & 0x40 && p[3] & 0x20 && p[4] && p[5] & 0x40)
+            random_access++;
+        if (p[3] & 0x20 && p[4] && p[5] & 0x10)
+        {
+            pcr = (int64_t)p[6] << 25 | p[7] << 17 | p[8] << 9 | p[9] << 1 | p[10] >> 7;
+            if (last_pcr >= 0 && pcr < last_pcr)
+                fail("PCR goes back in packet", (int)(i / TSMUX_PACKET_SIZE));
+            if (last_pcr >= 0 && pcr - last_pcr > max_pcr_gap)
+                max_pcr_gap = pcr - last_pcr;
+            last_pcr = pcr;
+        }
+        if (pid == 0 && last_pcr >= 0)
+        {
+            if (last_pat >= 0 && last_pcr - last_pat > max_pat_gap)
+                max_pat_gap = last_pcr - last_pat;
+            last_pat = last_pcr;
+        }
+    }
+    printf("%zu packets, PCR at most %.1f ms and tables at most %.1f ms apart\n", out_len / TSMUX_PACKET_SIZE,
+           max_pcr_gap / 90.0, max_pat_gap / 90.0);
+    if (max_pcr_gap > 9000)
+        fail("PCR gap too long in 90 kHz units", max_pcr_gap);
+    if (max_pat_gap > 9000)
+        fail("Gap between the tables too long in 90 kHz units", max_pat_gap);
+    if (random_access != nkeys)
+        fail("Keyframes with the random access indicator", random_access);
+}
+
+static void compare(const AVPacket *pkt, const struct packet *p, int video, int n)
+{
+    // The ADTS header written by tsmux
+    int skip = video ? 0 : 7;
+
+    if (pkt->pts != p->pts + DELAY || pkt->dts != p->dts + DELAY)
+        fail(video ? "Time stamps differ in video packet" : "Time stamps differ in audio packet", n);
+    if (pkt->flags & AV_PKT_FLAG_CORRUPT)
+        fail("Corrupt packet", n);
+    if (!video && (pkt->size < 7 || pkt->data[0] != 0xff || (pkt->data[1] & 0xf0) != 0xf0 ||
+                   ((pkt->data[3] & 3) << 11 | pkt->data[4] << 3 | pkt->data[5] >> 5) != pkt->size))
+        fail("ADTS header wrong in audio packet", n);
+    if (pkt->size != p->size || memcmp(pkt->data + skip, p->data + skip, p->size - skip))
+        fail(video ? "Payload differs in video packet" : "Payload differs in audio packet", n);
+}
+
+static void demux()
+{
+    AVFormatContext *fmt = avformat_alloc_context();
+    unsigned char *buf = (unsigned char *)av_malloc(4096);
+    AVIOContext *pb = avio_alloc_context(buf, 4096, 0, 0, read_out, 0, 0);
+    AVPacket *pkt = av_packet_alloc();
+    int nv = 0, na = 0;
+
+    fmt->pb = pb;
+    // The packets are compared as they are in the stream
+    fmt->flags |= AVFMT_FLAG_NOPARSE | AVFMT_FLAG_NOFILLIN;
+    if (avformat_open_input(&fmt, "", av_find_input_format("mpegts"), 0) < 0)
+    {
+        fail("Cannot open the output with libavformat", 0);
+        return;
+    }
+    while (av_read_frame(fmt, pkt) >= 0)
+    {
+        AVStream *st = fmt->streams[pkt->stream_index];
+
+        if (st->id == VIDEO_PID && st->codecpar->codec_id == AV_CODEC_ID_H264)
+        {
+            if (nv < nvideo)
+                compare(pkt, &video[nv], 1, nv);
+            nv++;
+        }
+        else if (st->id == AUDIO_PID && st->codecpar->codec_id == AV_CODEC_ID_AAC)
+        {
+            if (na < naudio)
+                compare(pkt, &audio[na], 0, na);
+            na++;
+        }
+        else
+            fail("Packet of an unknown stream", st->id);
+        av_packet_unref(pkt);
+    }
+    printf("%d of %d video and %d of %d audio packets demuxed\n", nv, nvideo, na, naudio);
+    if (nv != nvideo || na != naudio)
+        fail("Packets missing or added", nv + na);
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+}
+
+int main()
+{
+    mux();
+    check_packets();
+    demux();
+    for (int i = 0; i < nvideo; i++)
+        free(video[i].data);
+    for (int i = 0; i < naudio; i++)
+        free(audio[i].data);
+    free(out);
+    printf(errors ? "FAILED\n" : "OK\n");
+    return errors ? 1 : 0;
+}
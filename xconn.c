@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include <X11/Xlib.h>
+
+#include "xconn.h"
+
+// X connections of the process. Opening one is a handshake followed by extension queries, so
+// they are opened once and shared: one connection receives the events of the catalog and the
+// windows, the captures borrow connections from a pool and give them back when they end
+static pthread_mutex_t xconn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Display *event_display;
+static Display *pool[XCONN_POOL];
+static int npool;
+
+// Has to be called before any other Xlib call
+int xconn_init()
+{
+    if (!XInitThreads())
+    {
+        fprintf(stderr, "Xlib without thread support\n");
+        return -1;
+    }
+    event_display = XOpenDisplay(NULL);
+    if (!event_display)
+    {
+        fprintf(stderr, "Cannot open display\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The connection for events, Xlib lets other threads make requests on it while one waits for
+// the next event
+Display *xconn_events()
+{
+    return event_display;
+}
+
+// A connection for one capture, used only by the thread that acquired it
+Display *xconn_acquire()
+{
+    Display *display = 0;
+
+    pthread_mutex_lock(&xconn_mutex);
+    if (npool)
+        display = pool[--npool];
+    pthread_mutex_unlock(&xconn_mutex);
+    if (!display)
+    {
+        display = XOpenDisplay(NULL);
+        if (!display)
+            fprintf(stderr, "Cannot open display\n");
+    }
+    return display;
+}
+
+void xconn_release(Display *display)
+{
+    // Errors of the last capture are reported now, not to the next one
+    XSync(display, False);
+    pthread_mutex_lock(&xconn_mutex);
+    if (npool < XCONN_POOL)
+    {
+        pool[npool++] = display;
+        display = 0;
+    }
+    pthread_mutex_unlock(&xconn_mutex);
+    if (display)
+        XCloseDisplay(display);
+}
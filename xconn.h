@@ -0,0 +1,23 @@
+#ifndef _XCONN_H_INCLUDED_
+#define _XCONN_H_INCLUDED_
+
+#include <X11/Xlib.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Idle capture connections kept open for the next stream
+#define XCONN_POOL 8
+
+    int xconn_init();
+    Display *xconn_events();
+    Display *xconn_acquire();
+    void xconn_release(Display *display);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif